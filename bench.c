@@ -0,0 +1,503 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "rtree.h"
+
+// usage: bench [-n entries] [-d uniform|clustered|geo] [-q queries] [-s seed] [-S split] [-f csv|json] [-H]
+//
+// -S takes an enum rtree_split value, or SPLIT_HILBERT for the hilbert r-tree mode. every phase prints one row, csv rows share the header printed first unless -H is given,
+// json rows are one object per line so the output of several runs can simply be concatenated. nodes_visited comes from the
+// tree's work counters and stays 0 unless built with make bench BENCH_CFLAGS=-DRTREE_STATS, which slows the timed phases down
+
+#define SAMPLES (1 << 20)   // per-op latencies kept for the percentiles, long phases are sampled evenly
+#define NEARBY_K 10
+#define QUERY_HITS 100      // window queries are scaled to hit about this many entries, see calibrate
+#define SPLIT_HILBERT 3     // -S value selecting rtree_set_hilbert over the lon/lat plane
+#define SHARDS 8            // shards of the sharded index phases, ingested on as many threads
+
+static uint64_t seed;
+
+double rnd() {
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return (seed >> 11) * (1.0 / 9007199254740992.0);
+}
+
+double gauss() {
+    double u = rnd();
+    while (u == 0) { u = rnd(); }
+    return sqrt(-2 * log(u)) * cos(2 * M_PI * rnd());
+}
+
+double clamp(double x, double lo, double hi) {
+    return MAX(lo, MIN(hi, x));
+}
+
+void point(struct rect *rect, double lon, double lat) {
+    rect->min[0] = rect->max[0] = clamp(lon, -180, 180);
+    rect->min[1] = rect->max[1] = clamp(lat, -90, 90);
+}
+
+void gen_uniform(struct rect *rects, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        point(&rects[i], rnd() * 360 - 180, rnd() * 180 - 90);
+    }
+}
+
+// dense gaussian blobs of a thousand points each
+void gen_clustered(struct rect *rects, size_t n) {
+    double lon = 0, lat = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (i % 1000 == 0) {
+            lon = rnd() * 360 - 180;
+            lat = rnd() * 180 - 90;
+        }
+        point(&rects[i], lon + gauss() * 0.5, lat + gauss() * 0.5);
+    }
+}
+
+// shaped like map data: settlements of zipf-distributed size crowded into the northern mid-latitudes,
+// mostly points with some small boxes (buildings, roads) and a few large ones (districts, parks)
+void gen_geo(struct rect *rects, size_t n) {
+    size_t ncities = n / 500 + 1;
+    double *lon = malloc(ncities * sizeof(double)), *lat = malloc(ncities * sizeof(double)), *cdf = malloc(ncities * sizeof(double));
+    if (!lon || !lat || !cdf) {
+        panic("out of memory");
+    }
+    double total = 0;
+    for (size_t i = 0; i < ncities; i++) {
+        lon[i] = rnd() * 360 - 180;
+        lat[i] = clamp(30 + gauss() * 20, -60, 75);
+        total += 1.0 / (i + 1);
+        cdf[i] = total;
+    }
+    for (size_t i = 0; i < n; i++) {
+        double w = rnd() * total;
+        size_t lo = 0, hi = ncities - 1;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (cdf[mid] < w) { lo = mid + 1; } else { hi = mid; }
+        }
+        double spread = 0.02 + 0.3 / sqrt(lo + 1);
+        point(&rects[i], lon[lo] + gauss() * spread, lat[lo] + gauss() * spread);
+        double kind = rnd();
+        double size = kind < 0.01 ? exp(gauss() - 1) : kind < 0.1 ? exp(gauss() - 7) : 0;
+        rects[i].max[0] = clamp(rects[i].max[0] + size * (0.5 + rnd()), -180, 180);
+        rects[i].max[1] = clamp(rects[i].max[1] + size * (0.5 + rnd()), -90, 90);
+    }
+    free(lon);
+    free(lat);
+    free(cdf);
+}
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+struct phase {
+    const char *name;
+    size_t ops;
+    double secs;
+    double *lat;        // sampled per-op latencies in ns
+    size_t nlat;
+    size_t stride;      // every stride-th op is timed on its own
+    double visits;      // nodes visited per query, 0 unless built with -DRTREE_STATS
+    double hits;        // results per query, 0 when not measured
+};
+
+void phase_begin(struct phase *ph, const char *name, size_t ops, double *lat) {
+    memset(ph, 0, sizeof(struct phase));
+    ph->name = name;
+    ph->ops = ops;
+    ph->lat = lat;
+    ph->stride = ops / SAMPLES + 1;
+}
+
+int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+double percentile(struct phase *ph, double p) {
+    if (ph->nlat == 0) {
+        return 0;
+    }
+    return ph->lat[MIN(ph->nlat - 1, (size_t)(p * ph->nlat))];
+}
+
+// nodes a window query touches, walks the tree the same way node_search does
+struct config {
+    size_t n;
+    size_t queries;
+    const char *dataset;
+    int split;
+    bool json;
+};
+
+void report(struct config *cfg, struct phase *ph, struct rtree *tr) {
+    qsort(ph->lat, ph->nlat, sizeof(double), cmp_double);
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    struct rtree_stats st;
+    rtree_stats(tr, &st);
+    const char *fmt = cfg->json ?
+        "{\"dataset\":\"%s\",\"n\":%zu,\"max_entries\":%d,\"split\":%d,\"phase\":\"%s\",\"ops\":%zu,\"secs\":%.6f,"
+        "\"ops_per_sec\":%.0f,\"p50_ns\":%.0f,\"p90_ns\":%.0f,\"p99_ns\":%.0f,\"max_ns\":%.0f,"
+        "\"nodes_visited\":%.2f,\"hits\":%.2f,\"height\":%d,\"fill\":%.3f,\"overlap\":%.6g,\"dead_space\":%.6g,"
+        "\"tree_bytes\":%zu,\"peak_rss_kb\":%ld}\n" :
+        "%s,%zu,%d,%d,%s,%zu,%.6f,%.0f,%.0f,%.0f,%.0f,%.0f,%.2f,%.2f,%d,%.3f,%.6g,%.6g,%zu,%ld\n";
+    printf(fmt, cfg->dataset, cfg->n, MAX_ENTRIES, cfg->split, ph->name, ph->ops, ph->secs,
+        ph->secs > 0 ? ph->ops / ph->secs : 0, percentile(ph, 0.5), percentile(ph, 0.9), percentile(ph, 0.99),
+        ph->nlat ? ph->lat[ph->nlat - 1] : 0, ph->visits, ph->hits, st.height, st.fill, st.overlap, st.dead_space, st.memory, ru.ru_maxrss);
+    fflush(stdout);
+}
+
+bool count_iter(const double *min, const double *max, const void *data, void *udata) {
+    (void)min; (void)max; (void)data;
+    (*(size_t *)udata)++;
+    return true;
+}
+
+bool join_iter(const double *amin, const double *amax, const void *adata, const double *bmin, const double *bmax, const void *bdata, void *udata) {
+    (void)amin; (void)amax; (void)adata; (void)bmin; (void)bmax; (void)bdata;
+    (*(size_t *)udata)++;
+    return true;
+}
+
+bool nearby_iter(const double *min, const double *max, const void *data, double dist, void *udata) {
+    (void)min; (void)max; (void)data; (void)dist;
+    (*(size_t *)udata)++;
+    return true;
+}
+
+// scales the windows until they hit about QUERY_HITS entries, keeps skewed datasets comparable to uniform ones
+void calibrate(struct config *cfg, struct rtree *tr, struct rect *queries) {
+    size_t sample = MIN(cfg->queries, 1000);
+    for (int round = 0; round < 8; round++) {
+        size_t hits = 0;
+        for (size_t i = 0; i < sample; i++) {
+            rtree_search(tr, queries[i].min, queries[i].max, count_iter, &hits);
+        }
+        double scale = clamp(sqrt(QUERY_HITS / ((double)hits / sample)), 0.25, 4);
+        if (fabs(scale - 1) < 0.05) {
+            break;
+        }
+        for (size_t i = 0; i < cfg->queries; i++) {
+            for (int d = 0; d < DIMS; d++) {
+                double mid = (queries[i].min[d] + queries[i].max[d]) / 2, half = (queries[i].max[d] - queries[i].min[d]) / 2 * scale;
+                queries[i].min[d] = mid - half;
+                queries[i].max[d] = mid + half;
+            }
+        }
+    }
+}
+
+void bench_insert(struct config *cfg, struct phase *ph, struct rtree *tr, struct rect *rects) {
+    double start = now();
+    for (size_t i = 0; i < cfg->n; i++) {
+        double t = i % ph->stride == 0 ? now() : 0;
+        if (!rtree_insert(tr, rects[i].min, rects[i].max, (void *)(uintptr_t)(i + 1))) {
+            panic("out of memory");
+        }
+        if (t != 0) {
+            ph->lat[ph->nlat++] = (now() - t) * 1e9;
+        }
+    }
+    ph->secs = now() - start;
+}
+
+void bench_search(struct config *cfg, struct phase *ph, struct rtree *tr, struct rect *queries) {
+    size_t hits = 0;
+    uint64_t visited = tr->counters.nodes_visited;
+    double start = now();
+    for (size_t i = 0; i < cfg->queries; i++) {
+        double t = i % ph->stride == 0 ? now() : 0;
+        rtree_search(tr, queries[i].min, queries[i].max, count_iter, &hits);
+        if (t != 0) {
+            ph->lat[ph->nlat++] = (now() - t) * 1e9;
+        }
+    }
+    ph->secs = now() - start;
+    ph->visits = (double)(tr->counters.nodes_visited - visited) / cfg->queries;
+    ph->hits = (double)hits / cfg->queries;
+}
+
+void bench_count(struct config *cfg, struct phase *ph, struct rtree *tr, struct rect *queries) {
+    size_t hits = 0;
+    uint64_t visited = tr->counters.nodes_visited;
+    double start = now();
+    for (size_t i = 0; i < cfg->queries; i++) {
+        double t = i % ph->stride == 0 ? now() : 0;
+        hits += rtree_count_in(tr, queries[i].min, queries[i].max);
+        if (t != 0) {
+            ph->lat[ph->nlat++] = (now() - t) * 1e9;
+        }
+    }
+    ph->secs = now() - start;
+    ph->visits = (double)(tr->counters.nodes_visited - visited) / cfg->queries;
+    ph->hits = (double)hits / cfg->queries;
+}
+
+void bench_nearby(struct config *cfg, struct phase *ph, struct rtree *tr, struct rect *queries) {
+    (void)cfg;
+    size_t hits = 0;
+    uint64_t visited = tr->counters.nodes_visited;
+    double start = now();
+    for (size_t i = 0; i < ph->ops; i++) {
+        double t = i % ph->stride == 0 ? now() : 0;
+        if (!rtree_nearby(tr, queries[i].min, NEARBY_K, nearby_iter, &hits)) {
+            panic("out of memory");
+        }
+        if (t != 0) {
+            ph->lat[ph->nlat++] = (now() - t) * 1e9;
+        }
+    }
+    ph->secs = now() - start;
+    ph->visits = (double)(tr->counters.nodes_visited - visited) / ph->ops;
+    ph->hits = (double)hits / ph->ops;
+}
+
+// joins a tree of the query windows against the tree, the same pairs the search phase finds one window at a time
+void bench_join(struct config *cfg, struct phase *ph, struct rtree *tr, struct rect *queries) {
+    struct rtree *qt = rtree_new();
+    DATATYPE *ids = malloc(cfg->queries * sizeof(DATATYPE));
+    if (!qt || !ids) {
+        panic("out of memory");
+    }
+    for (size_t i = 0; i < cfg->queries; i++) {
+        ids[i] = (void *)(uintptr_t)(i + 1);
+    }
+    if (!rtree_bulk_load(qt, queries, ids, cfg->queries)) {
+        panic("out of memory");
+    }
+    size_t hits = 0;
+    double start = now();
+    if (!rtree_join(qt, tr, join_iter, &hits)) {
+        panic("out of memory");
+    }
+    ph->secs = now() - start;
+    ph->hits = (double)hits / cfg->queries;
+    rtree_free(qt);
+    free(ids);
+}
+
+// batch ingest into a sharded index framed by the tree, followed by a rebalance and the windows fanned out over the shards
+void bench_shards(struct config *cfg, struct phase *ph, struct rtree *tr, struct rect *rects, DATATYPE *items, struct rect *queries) {
+    struct rtree_shards *s = rtree_shards_new(SHARDS, tr->rect.min, tr->rect.max);
+    if (!s) {
+        panic("out of memory");
+    }
+    phase_begin(ph, "shard_ingest", cfg->n, ph->lat);
+    double start = now();
+    if (!rtree_shards_insert_batch(s, rects, items, cfg->n, SHARDS)) {
+        panic("out of memory");
+    }
+    ph->secs = now() - start;
+    report(cfg, ph, tr);
+    phase_begin(ph, "shard_rebalance", cfg->n, ph->lat);
+    start = now();
+    if (!rtree_shards_rebalance(s)) {
+        panic("out of memory");
+    }
+    ph->secs = now() - start;
+    report(cfg, ph, tr);
+    phase_begin(ph, "shard_search", cfg->queries, ph->lat);
+    size_t hits = 0;
+    start = now();
+    for (size_t i = 0; i < cfg->queries; i++) {
+        double t = i % ph->stride == 0 ? now() : 0;
+        rtree_shards_search(s, queries[i].min, queries[i].max, count_iter, &hits);
+        if (t != 0) {
+            ph->lat[ph->nlat++] = (now() - t) * 1e9;
+        }
+    }
+    ph->secs = now() - start;
+    ph->hits = (double)hits / cfg->queries;
+    report(cfg, ph, tr);
+    rtree_shards_free(s);
+}
+
+// deletes every other entry so the tree is left half full
+void bench_delete(struct config *cfg, struct phase *ph, struct rtree *tr, struct rect *rects) {
+    double start = now();
+    for (size_t i = 0; i < ph->ops; i++) {
+        size_t j = i * 2;
+        double t = i % ph->stride == 0 ? now() : 0;
+        rtree_delete(tr, rects[j].min, rects[j].max, (void *)(uintptr_t)(j + 1));
+        if (t != 0) {
+            ph->lat[ph->nlat++] = (now() - t) * 1e9;
+        }
+    }
+    ph->secs = now() - start;
+    if (rtree_count(tr) != cfg->n - ph->ops) {
+        panic("delete missed entries");
+    }
+}
+
+// a fresh tree in the mode given by -S
+struct rtree *new_tree(struct config *cfg) {
+    struct rtree *tr = rtree_new();
+    if (!tr) {
+        panic("out of memory");
+    }
+    if (cfg->split == SPLIT_HILBERT) {
+        double min[2] = { -180, -90 }, max[2] = { 180, 90 };
+        if (!rtree_set_hilbert(tr, min, max)) {
+            panic("out of memory");
+        }
+    } else {
+        rtree_set_split(tr, cfg->split);
+    }
+    return tr;
+}
+
+// saves the tree and reopens it mapped, in the exact or the packed layout
+struct rtree *map_tree(struct rtree *tr, bool packed) {
+    char path[] = "/tmp/rtree_bench_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        panic("cannot create the map file");
+    }
+    close(fd);
+    if (!(packed ? rtree_save_packed(tr, path) : rtree_save(tr, path))) {
+        panic("cannot save the tree");
+    }
+    struct rtree *mt = rtree_open_mmap(path);
+    unlink(path);
+    if (!mt) {
+        panic("cannot map the tree");
+    }
+    return mt;
+}
+
+void usage() {
+    fprintf(stderr, "usage: bench [-n entries] [-d uniform|clustered|geo] [-q queries] [-s seed] [-S split] [-f csv|json] [-H]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    struct config cfg = { .n = 1000000, .dataset = "uniform" };
+    bool header = true;
+    seed = 88172645463325252ULL;
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i], *val = i + 1 < argc ? argv[i + 1] : NULL;
+        if (!strcmp(arg, "-H")) {
+            header = false;
+            continue;
+        }
+        if (!val) {
+            usage();
+        }
+        i++;
+        if (!strcmp(arg, "-n")) {
+            cfg.n = strtoull(val, NULL, 10);
+        } else if (!strcmp(arg, "-d")) {
+            cfg.dataset = val;
+        } else if (!strcmp(arg, "-q")) {
+            cfg.queries = strtoull(val, NULL, 10);
+        } else if (!strcmp(arg, "-s")) {
+            seed = strtoull(val, NULL, 10) | 1;
+        } else if (!strcmp(arg, "-S")) {
+            cfg.split = atoi(val);
+        } else if (!strcmp(arg, "-f")) {
+            cfg.json = !strcmp(val, "json");
+        } else {
+            usage();
+        }
+    }
+    if (cfg.n == 0) {
+        usage();
+    }
+    if (cfg.queries == 0) {
+        cfg.queries = MIN(cfg.n, 100000);
+    }
+
+    struct rect *rects = malloc(cfg.n * sizeof(struct rect));
+    struct rect *queries = malloc(cfg.queries * sizeof(struct rect));
+    DATATYPE *items = malloc(cfg.n * sizeof(DATATYPE));
+    double *lat = malloc(SAMPLES * sizeof(double));
+    if (!rects || !queries || !items || !lat) {
+        panic("out of memory");
+    }
+    if (!strcmp(cfg.dataset, "uniform")) {
+        gen_uniform(rects, cfg.n);
+    } else if (!strcmp(cfg.dataset, "clustered")) {
+        gen_clustered(rects, cfg.n);
+    } else if (!strcmp(cfg.dataset, "geo")) {
+        gen_geo(rects, cfg.n);
+    } else {
+        usage();
+    }
+    // windows centred on entries of the dataset so that skewed datasets are queried where their data is
+    double side = sqrt(360.0 * 180.0 * QUERY_HITS / cfg.n);
+    for (size_t i = 0; i < cfg.queries; i++) {
+        struct rect *r = &rects[(size_t)(rnd() * cfg.n)];
+        for (int d = 0; d < DIMS; d++) {
+            queries[i].min[d] = r->min[d] - side / 2;
+            queries[i].max[d] = r->min[d] + side / 2;
+        }
+    }
+    for (size_t i = 0; i < cfg.n; i++) {
+        items[i] = (void *)(uintptr_t)(i + 1);
+    }
+
+    if (header && !cfg.json) {
+        printf("dataset,n,max_entries,split,phase,ops,secs,ops_per_sec,p50_ns,p90_ns,p99_ns,max_ns,"
+            "nodes_visited,hits,height,fill,overlap,dead_space,tree_bytes,peak_rss_kb\n");
+    }
+    struct phase ph;
+    struct rtree *tr = new_tree(&cfg);
+    phase_begin(&ph, "insert", cfg.n, lat);
+    bench_insert(&cfg, &ph, tr, rects);
+    report(&cfg, &ph, tr);
+    calibrate(&cfg, tr, queries);
+    phase_begin(&ph, "search", cfg.queries, lat);
+    bench_search(&cfg, &ph, tr, queries);
+    report(&cfg, &ph, tr);
+    phase_begin(&ph, "count", cfg.queries, lat);
+    bench_count(&cfg, &ph, tr, queries);
+    report(&cfg, &ph, tr);
+    phase_begin(&ph, "nearby", MAX(cfg.queries / 10, 1), lat);
+    bench_nearby(&cfg, &ph, tr, queries);
+    report(&cfg, &ph, tr);
+    phase_begin(&ph, "delete", cfg.n / 2, lat);
+    bench_delete(&cfg, &ph, tr, rects);
+    report(&cfg, &ph, tr);
+    rtree_free(tr);
+
+    tr = new_tree(&cfg);
+    phase_begin(&ph, "bulk_load", cfg.n, lat);
+    double start = now();
+    if (!rtree_bulk_load(tr, rects, items, cfg.n)) {
+        panic("out of memory");
+    }
+    ph.secs = now() - start;
+    report(&cfg, &ph, tr);
+    phase_begin(&ph, "bulk_search", cfg.queries, lat);
+    bench_search(&cfg, &ph, tr, queries);
+    report(&cfg, &ph, tr);
+    phase_begin(&ph, "join", cfg.queries, lat);
+    bench_join(&cfg, &ph, tr, queries);
+    report(&cfg, &ph, tr);
+    bench_shards(&cfg, &ph, tr, rects, items, queries);
+    for (int packed = 0; packed < 2; packed++) {
+        struct rtree *mt = map_tree(tr, packed);
+        phase_begin(&ph, packed ? "packed_search" : "mapped_search", cfg.queries, lat);
+        bench_search(&cfg, &ph, mt, queries);
+        report(&cfg, &ph, mt);
+        rtree_free(mt);
+    }
+    rtree_free(tr);
+
+    free(rects);
+    free(queries);
+    free(items);
+    free(lat);
+    return 0;
+}
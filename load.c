@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "rtree.h"
+
+// usage: load [-f csv|bin] [-t threads] [-o tree] [-p] input
+//
+// loads a point file with rtree_load_file and reports the throughput. -o saves the tree for rtree_open_mmap,
+// in the quantized layout with -p. threads default to the number of online cpus
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void usage() {
+    fprintf(stderr, "usage: load [-f csv|bin] [-t threads] [-o tree] [-p] input\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    enum rtree_file_format format = RTREE_FILE_CSV;
+    int nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    const char *input = NULL, *output = NULL;
+    bool packed = false;
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i], *val = i + 1 < argc ? argv[i + 1] : NULL;
+        if (!strcmp(arg, "-p")) {
+            packed = true;
+            continue;
+        }
+        if (arg[0] != '-' && !input) {
+            input = arg;
+            continue;
+        }
+        if (!val) {
+            usage();
+        }
+        i++;
+        if (!strcmp(arg, "-f")) {
+            format = !strcmp(val, "bin") ? RTREE_FILE_BINARY : RTREE_FILE_CSV;
+        } else if (!strcmp(arg, "-t")) {
+            nthreads = atoi(val);
+        } else if (!strcmp(arg, "-o")) {
+            output = val;
+        } else {
+            usage();
+        }
+    }
+    if (!input) {
+        usage();
+    }
+
+    FILE *f = fopen(input, "rb");
+    if (!f) {
+        panic("cannot open the input");
+    }
+    fseek(f, 0, SEEK_END);
+    double mb = ftell(f) / 1e6;
+    fclose(f);
+    struct rtree *tr = rtree_new();
+    if (!tr) {
+        panic("out of memory");
+    }
+    double start = now();
+    if (!rtree_load_file(tr, input, format, nthreads)) {
+        panic("cannot load the input");
+    }
+    double secs = now() - start;
+    printf("%zu points from %.1f MB in %.3f secs on %d threads, %.1f MB/s, %.0f points/s\n",
+        rtree_count(tr), mb, secs, MAX(nthreads, 1), mb / secs, rtree_count(tr) / secs);
+    if (output && !(packed ? rtree_save_packed(tr, output) : rtree_save(tr, output))) {
+        panic("cannot save the tree");
+    }
+    rtree_free(tr);
+    return 0;
+}
@@ -22,6 +22,45 @@ bool city_iter(const double *min, const double *max, const void *item, void *uda
     return true;
 }
 
+#define EARTH_RADIUS_KM 6371.0
+#define RAD(deg) ((deg) * M_PI / 180)
+
+double haversine(double lat1, double lon1, double lat2, double lon2) {
+    double dlat = RAD(lat2 - lat1), dlon = RAD(lon2 - lon1);
+    double a = sin(dlat / 2) * sin(dlat / 2) + cos(RAD(lat1)) * cos(RAD(lat2)) * sin(dlon / 2) * sin(dlon / 2);
+    return 2 * EARTH_RADIUS_KM * asin(sqrt(MIN(1, a)));
+}
+
+double normalize_lon(double dlon) {
+    while (dlon > 180) { dlon -= 360; }
+    while (dlon < -180) { dlon += 360; }
+    return dlon;
+}
+
+// great-circle distance from point {lon, lat} to the closest point of a {lon, lat} box
+double city_dist(const double *min, const double *max, const double *point, void *udata) {
+    (void)udata;
+    double lon = point[0], lat = point[1];
+    if (lon >= min[0] && lon <= max[0]) { // straight along the meridian
+        return haversine(lat, lon, MAX(min[1], MIN(max[1], lat)), lon);
+    }
+    // otherwise the closest point lies on the nearest meridian edge of the box
+    double dmin = normalize_lon(min[0] - lon), dmax = normalize_lon(max[0] - lon);
+    double dlon = fabs(dmin) < fabs(dmax) ? dmin : dmax;
+    double elat = lat >= 0 ? 90 : -90;
+    if (fabs(dlon) < 90) {
+        elat = atan(tan(RAD(lat)) / cos(RAD(dlon))) * 180 / M_PI;
+    }
+    return haversine(lat, lon, MAX(min[1], MIN(max[1], elat)), lon + dlon);
+}
+
+bool nearby_iter(const double *min, const double *max, const void *item, double dist, void *udata) {
+    (void)min; (void)max; (void)udata;
+    const struct city *city = item;
+    printf("%s (%.0f km)\n", city->name, dist);
+    return true;
+}
+
 int main() {
     struct rtree *tr = rtree_new();
     rtree_insert(tr, (double[2]){nsk.longitude, nsk.latitude}, NULL, &nsk);
@@ -40,6 +79,9 @@ int main() {
     printf("\nSoutheastern cities:\n");
     rtree_search(tr, (double[2]){0, -90}, (double[2]){180, 0}, city_iter, NULL);
 
+    printf("\nThree cities nearest to Moscow:\n");
+    rtree_nearby_with_dist(tr, (double[2]){37.6173, 55.7558}, 3, city_dist, nearby_iter, NULL);
+
     rtree_delete(tr, (double[2]){nsk.longitude, nsk.latitude}, NULL, &nsk);
     printf("\nNortheastern cities after element deletion:\n");
     rtree_search(tr, (double[2]){0, 0}, (double[2]){180, 90}, city_iter, NULL);
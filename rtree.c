@@ -1,33 +1,339 @@
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <float.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "rtree.h"
 
-struct node *node_new(struct rtree *tr, enum kind kind) {
-    struct node *node = (struct node *)tr->malloc(sizeof(struct node));
-    memset(node, 0, sizeof(struct node));
-    node->kind = kind;
+#define NODE_ALIGN 64       // nodes start on a cache line
+#define SLAB_ALIGN 4096     // slabs start on a page
+#define SLAB_MAX_NODES 1024
+#define NODE_BYTES(_hilbert_) ((_hilbert_) ? sizeof(struct node) : offsetof(struct node, keys)) // keys only in hilbert mode
+
+// bumps one of tr->counters, compiled out unless built with -DRTREE_STATS. relaxed atomics since
+// searches may run on several threads at once, the counters change even through a const tree
+#ifdef RTREE_STATS
+#define STAT(_tr_, _counter_, _n_) __atomic_add_fetch(&((struct rtree *)(_tr_))->counters._counter_, (uint64_t)(_n_), __ATOMIC_RELAXED)
+#else
+#define STAT(_tr_, _counter_, _n_) ((void)0)
+#endif
+
+// trailer of every slab, stored after its nodes so the first node is page aligned
+struct slab {
+    struct slab *next;
+    void *mem;          // block returned by tr->malloc
+};
+
+static struct node_pool *pool_new(struct rtree *tr) {
+    struct node_pool *pool = (struct node_pool *)tr->malloc(sizeof(struct node_pool));
+    if (!pool) { return NULL; }
+    memset(pool, 0, sizeof(struct node_pool));
+    pool->node_size = (NODE_BYTES(tr->hilbert) + NODE_ALIGN - 1) / NODE_ALIGN * NODE_ALIGN;
+    pool->refs = 1;
+    pthread_mutex_init(&pool->lock, NULL);
+    return pool;
+}
+
+// trees made by rtree_clone share nodes for as long as they share the pool
+static bool pool_shared(struct rtree *tr) {
+    return __atomic_load_n(&tr->pool->refs, __ATOMIC_ACQUIRE) > 1;
+}
+
+// a pool used by a single tree is only touched by its writer and needs no lock
+static bool pool_lock(struct rtree *tr) {
+    if (!pool_shared(tr)) { return false; }
+    pthread_mutex_lock(&tr->pool->lock);
+    return true;
+}
+
+static void pool_unlock(struct rtree *tr, bool locked) {
+    if (locked) { pthread_mutex_unlock(&tr->pool->lock); }
+}
+
+// free nodes are linked through their first word, always accessed with memcpy since the
+// same memory is written as a struct node once handed out
+static void pool_push(struct node_pool *pool, void *ptr) {
+    memcpy(ptr, &pool->free, sizeof(void *));
+    pool->free = ptr;
+}
+
+static bool pool_grow(struct rtree *tr) {
+    struct node_pool *pool = tr->pool;
+    size_t nodes = pool->slab_nodes ? MIN(pool->slab_nodes * 2, SLAB_MAX_NODES) : 8;
+    size_t bytes = nodes * pool->node_size + sizeof(struct slab) + SLAB_ALIGN - 1;
+    void *mem = tr->malloc(bytes);
+    if (!mem) { return false; }
+    char *base = (char *)(((uintptr_t)mem + SLAB_ALIGN - 1) & ~(uintptr_t)(SLAB_ALIGN - 1));
+    struct slab *slab = (struct slab *)(base + nodes * pool->node_size);
+    slab->mem = mem;
+    slab->next = (struct slab *)pool->slabs;
+    pool->slabs = slab;
+    for (size_t i = nodes; i > 0; i--) { // lowest addresses are handed out first
+        pool_push(pool, base + (i - 1) * pool->node_size);
+    }
+    pool->slab_nodes = nodes;
+    pool->bytes += bytes;
+    return true;
+}
+
+static void *pool_alloc(struct rtree *tr) {
+    if (tr->reserve.len > 0) {
+        STAT(tr, allocs, 1);
+        return tr->reserve.nodes[--tr->reserve.len];
+    }
+    bool locked = pool_lock(tr);
+    void *block = NULL;
+    if (tr->pool->free || pool_grow(tr)) {
+        block = tr->pool->free;
+        memcpy(&tr->pool->free, block, sizeof(void *));
+        STAT(tr, allocs, 1);
+    }
+    pool_unlock(tr, locked);
+    return block;
+}
+
+static void pool_release(struct rtree *tr, void *ptr) {
+    bool locked = pool_lock(tr);
+    pool_push(tr->pool, ptr);
+    pool_unlock(tr, locked);
+}
+
+// sets n nodes aside for pool_alloc so that an operation can allocate its nodes before it changes anything
+static bool pool_reserve(struct rtree *tr, size_t n) {
+    struct node_list *reserve = &tr->reserve;
+    if (n == 0) { return true; }
+    reserve->nodes = (struct node **)tr->malloc(n * sizeof(struct node *));
+    if (!reserve->nodes) { return false; }
+    reserve->cap = n;
+    bool locked = pool_lock(tr);
+    for (reserve->len = 0; reserve->len < n; reserve->len++) {
+        if (!tr->pool->free && !pool_grow(tr)) { break; }
+        reserve->nodes[reserve->len] = (struct node *)tr->pool->free;
+        memcpy(&tr->pool->free, tr->pool->free, sizeof(void *));
+    }
+    pool_unlock(tr, locked);
+    return reserve->len == n;
+}
+
+// hands the nodes left over from pool_reserve back to the pool
+static void pool_unreserve(struct rtree *tr) {
+    struct node_list *reserve = &tr->reserve;
+    while (reserve->len > 0) {
+        pool_release(tr, reserve->nodes[--reserve->len]);
+    }
+    if (reserve->nodes) { tr->free(reserve->nodes); }
+    memset(reserve, 0, sizeof(struct node_list));
+}
+
+// returns every slab at once, nodes still in use are gone with them
+static void pool_free(struct rtree *tr, struct node_pool *pool) {
+    struct slab *slab = (struct slab *)pool->slabs;
+    while (slab) {
+        struct slab *next = slab->next;
+        tr->free(slab->mem);
+        slab = next;
+    }
+    pthread_mutex_destroy(&pool->lock);
+    tr->free(pool);
+}
+
+static void *workers_thread(void *arg) {
+    struct worker_pool *pool = (struct worker_pool *)arg;
+    uint64_t seen = 0;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->stop && (pool->wanted == 0 || pool->call == seen)) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        if (pool->stop) {
+            break;
+        }
+        seen = pool->call;
+        pool->wanted--;
+        pool->working++;
+        void *(*work)(void *) = pool->work;
+        void *work_arg = pool->arg;
+        pthread_mutex_unlock(&pool->lock);
+        work(work_arg);
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->working == 0) {
+            pthread_cond_signal(&pool->done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+// starts threads until the pool has n of them, fewer when memory or threads run out
+static void workers_grow(struct worker_pool *pool, void *(*malloc_fn)(size_t), void (*free_fn)(void *), int n) {
+    if (n > pool->cap) {
+        pthread_t *threads = (pthread_t *)malloc_fn(n * sizeof(pthread_t));
+        if (!threads) { return; }
+        if (pool->threads) {
+            memcpy(threads, pool->threads, pool->count * sizeof(pthread_t));
+            free_fn(pool->threads);
+        }
+        pool->threads = threads;
+        pool->cap = n;
+    }
+    while (pool->count < n && pthread_create(&pool->threads[pool->count], NULL, workers_thread, pool) == 0) {
+        pool->count++;
+    }
+}
+
+// runs work(arg) on the calling thread and on up to nthreads - 1 threads of the pool at *slot, which is created
+// on first use and grows as calls ask for more threads. work must return once the work it shares with the other
+// threads is done, a thread that comes late finds none left. without memory for the pool, or while another call
+// has it, work runs on the calling thread alone
+static void workers_run(struct worker_pool **slot, void *(*malloc_fn)(size_t), void (*free_fn)(void *), int nthreads, void *(*work)(void *), void *arg) {
+    struct worker_pool *pool = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (nthreads > 1 && !pool && (pool = (struct worker_pool *)malloc_fn(sizeof(struct worker_pool)))) {
+        memset(pool, 0, sizeof(struct worker_pool));
+        pthread_mutex_init(&pool->lock, NULL);
+        pthread_cond_init(&pool->wake, NULL);
+        pthread_cond_init(&pool->done, NULL);
+        struct worker_pool *expected = NULL;
+        if (!__atomic_compare_exchange_n(slot, &expected, pool, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            pthread_cond_destroy(&pool->done); // another thread made the pool first
+            pthread_cond_destroy(&pool->wake);
+            pthread_mutex_destroy(&pool->lock);
+            free_fn(pool);
+            pool = expected;
+        }
+    }
+    if (nthreads <= 1 || !pool) {
+        work(arg);
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    if (pool->busy) {
+        pthread_mutex_unlock(&pool->lock);
+        work(arg);
+        return;
+    }
+    pool->busy = true;
+    workers_grow(pool, malloc_fn, free_fn, nthreads - 1);
+    pool->work = work;
+    pool->arg = arg;
+    pool->wanted = nthreads - 1;
+    pool->call++;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    work(arg);
+    pthread_mutex_lock(&pool->lock);
+    pool->wanted = 0; // threads that did not wake up in time sit this call out
+    while (pool->working > 0) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pool->busy = false;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void workers_free(struct worker_pool *pool, void (*free_fn)(void *)) {
+    if (!pool) { return; }
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->count; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    if (pool->threads) { free_fn(pool->threads); }
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+    free_fn(pool);
+}
+
+static struct node *node_new(struct rtree *tr, enum kind kind) {
+    struct node *node = (struct node *)pool_alloc(tr);
+    if (!node) { return NULL; }
+    node->kind = kind; // entries past count are never read, no need to clear them
+    node->count = 0;
+    node->rc = 1;
+    node->gen = tr->gen;
+    node->total = 0;
     return node;
 }
 
-void node_free(struct rtree *tr, struct node *node) {
+// items in the subtree of the node
+static size_t node_total(const struct node *node) {
+    return node->kind == LEAF ? (size_t)node->count : node->total;
+}
+
+// drops a reference to the node, the last owner releases the children and the node itself
+static void node_free(struct rtree *tr, struct node *node) {
+    if (__atomic_sub_fetch(&node->rc, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
     if (node->kind == BRANCH) {
         for (int i = 0; i < node->count; i++) {
             node_free(tr, node->children[i]);
         }
     }
-    tr->free(node);
+    pool_release(tr, node);
+}
+
+// hands a node unlinked by the writer over to reclamation, readers that started before
+// the new root was published may still walk it until they leave their epoch
+static void node_retire(struct rtree *tr, struct node *node) {
+    if (!tr->concurrent || node->gen == tr->gen) { // never published
+        node_free(tr, node);
+        return;
+    }
+    struct node_list *limbo = &tr->limbo[tr->epoch & 1];
+    if (limbo->len == limbo->cap) {
+        size_t cap = limbo->cap ? limbo->cap * 2 : MAX_ENTRIES;
+        struct node **nodes = (struct node **)tr->malloc(cap * sizeof(struct node *));
+        if (!nodes) { return; } // out of memory, leak the node rather than free it under a reader
+        if (limbo->nodes) {
+            memcpy(nodes, limbo->nodes, limbo->len * sizeof(struct node *));
+            tr->free(limbo->nodes);
+        }
+        limbo->nodes = nodes;
+        limbo->cap = cap;
+    }
+    limbo->nodes[limbo->len++] = node;
+}
+
+// published nodes in concurrent mode and nodes referenced by a clone must not be modified in place
+static bool node_shared(struct rtree *tr, struct node *node) {
+    return (tr->concurrent && node->gen != tr->gen) || __atomic_load_n(&node->rc, __ATOMIC_ACQUIRE) > 1;
+}
+
+// returns the node in a state the writer may modify, shared nodes are copied first
+static struct node *node_mut(struct rtree *tr, struct node *node) {
+    if (!node_shared(tr, node)) {
+        return node;
+    }
+    struct node *copy = (struct node *)pool_alloc(tr);
+    if (!copy) { return NULL; }
+    memcpy(copy, node, NODE_BYTES(tr->hilbert));
+    copy->rc = 1;
+    copy->gen = tr->gen;
+    if (copy->kind == BRANCH) { // children are now shared by the copy and the retired node
+        for (int i = 0; i < copy->count; i++) {
+            __atomic_add_fetch(&copy->children[i]->rc, 1, __ATOMIC_RELAXED);
+        }
+    }
+    node_retire(tr, node);
+    return copy;
 }
 
-void rect_expand(struct rect *rect, struct rect *other) {
+static void rect_expand(struct rect *rect, struct rect *other) {
     for (int i = 0; i < DIMS; i++) {
         if (other->min[i] < rect->min[i]) { rect->min[i] = other->min[i]; }
         if (other->max[i] > rect->max[i]) { rect->max[i] = other->max[i]; }
     }
 }
 
-double rect_area(struct rect *rect) {
+static double rect_area(const struct rect *rect) {
     double area = (double)(rect->max[0]) - (double)(rect->min[0]);
     for (int i = 1; i < DIMS; i++) {
         area *= (double)(rect->max[i]) - (double)(rect->min[i]);
@@ -35,7 +341,7 @@ double rect_area(struct rect *rect) {
     return area;
 }
 
-bool rect_contains(struct rect *rect, struct rect *other) {
+static bool rect_contains(const struct rect *rect, const struct rect *other) {
     for (int i = 0; i < DIMS; i++) {
         if (other->min[i] < rect->min[i] || other->max[i] > rect->max[i]) {
             return false;
@@ -44,7 +350,7 @@ bool rect_contains(struct rect *rect, struct rect *other) {
     return true;
 }
 
-bool rect_intersects(struct rect *rect, struct rect *other) {
+static bool rect_intersects(struct rect *rect, struct rect *other) {
     for (int i = 0; i < DIMS; i++) {
         if (other->min[i] > rect->max[i] || other->max[i] < rect->min[i]) {
             return false;
@@ -53,12 +359,337 @@ bool rect_intersects(struct rect *rect, struct rect *other) {
     return true;
 }
 
+#if defined(__GNUC__)
+#define word_first(_word_) __builtin_ctzll(_word_)
+#define word_count(_word_) __builtin_popcountll(_word_)
+#define prefetch(_ptr_) __builtin_prefetch(_ptr_)
+#else
+static int word_first(uint64_t word) {
+    int i = 0;
+    while (!(word & 1)) { word >>= 1; i++; }
+    return i;
+}
+static int word_count(uint64_t word) {
+    int n = 0;
+    for (; word; word &= word - 1) { n++; }
+    return n;
+}
+#define prefetch(_ptr_) ((void)(_ptr_))
+#endif
+
+// entry masks, see struct rtree_mask. with a fanout of up to 64 every loop below runs once and the
+// operations come down to the plain word operations
+static inline bool mask_any(const struct rtree_mask *mask) {
+    uint64_t any = 0;
+    for (int k = 0; k < RTREE_MASK_WORDS; k++) {
+        any |= mask->words[k];
+    }
+    return any != 0;
+}
+
+// removes the lowest entry from a mask that is not empty and returns it
+static inline int mask_take(struct rtree_mask *mask) {
+    int k = 0;
+    while (k < RTREE_MASK_WORDS - 1 && !mask->words[k]) {
+        k++;
+    }
+    int i = word_first(mask->words[k]);
+    mask->words[k] &= mask->words[k] - 1;
+    return k * 64 + i;
+}
+
+static inline bool mask_has(const struct rtree_mask *mask, int i) {
+    return mask->words[i / 64] >> (i % 64) & 1;
+}
+
+static inline void mask_set(struct rtree_mask *mask, int i) {
+    mask->words[i / 64] |= (uint64_t)1 << (i % 64);
+}
+
+static inline void mask_unset(struct rtree_mask *mask, int i) {
+    mask->words[i / 64] &= ~((uint64_t)1 << (i % 64));
+}
+
+static inline int mask_size(const struct rtree_mask *mask) {
+    int n = 0;
+    for (int k = 0; k < RTREE_MASK_WORDS; k++) {
+        n += word_count(mask->words[k]);
+    }
+    return n;
+}
+
+static inline struct rtree_mask mask_and(const struct rtree_mask *a, const struct rtree_mask *b) {
+    struct rtree_mask mask;
+    for (int k = 0; k < RTREE_MASK_WORDS; k++) {
+        mask.words[k] = a->words[k] & b->words[k];
+    }
+    return mask;
+}
+
+static inline struct rtree_mask mask_andnot(const struct rtree_mask *a, const struct rtree_mask *b) {
+    struct rtree_mask mask;
+    for (int k = 0; k < RTREE_MASK_WORDS; k++) {
+        mask.words[k] = a->words[k] & ~b->words[k];
+    }
+    return mask;
+}
+
+static inline void mask_or(struct rtree_mask *mask, const struct rtree_mask *other) {
+    for (int k = 0; k < RTREE_MASK_WORDS; k++) {
+        mask->words[k] |= other->words[k];
+    }
+}
+
+// adds the entries of other moved up by shift places
+static inline void mask_or_shifted(struct rtree_mask *mask, const struct rtree_mask *other, int shift) {
+    int ws = shift / 64, bs = shift % 64;
+    for (int k = RTREE_MASK_WORDS - 1; k >= ws; k--) {
+        uint64_t word = other->words[k - ws] << bs;
+        if (bs > 0 && k - ws > 0) {
+            word |= other->words[k - ws - 1] >> (64 - bs);
+        }
+        mask->words[k] |= word;
+    }
+}
+
+#define PREFETCH_LINES ((NODE_BYTES(false) + NODE_ALIGN - 1) / NODE_ALIGN) // whole nodes, the search reads rects and children
+
+// a macro rather than a function, gcc takes a function that only prefetches for one without effects and drops its calls
+#define node_prefetch(_node_) do { \
+    for (size_t _line_ = 0; _line_ < PREFETCH_LINES; _line_++) { \
+        prefetch((const char *)(_node_) + _line_ * NODE_ALIGN); \
+    } \
+} while (0)
+
+// tests the rect against count rects at once, bit i of the result is set when rects[i] intersects it
+static uint64_t rects_intersects_mask_scalar(const struct rect *rects, int count, const struct rect *rect) {
+    uint64_t mask = 0;
+    for (int i = 0; i < count; i++) {
+        if (rect_intersects((struct rect *)&rects[i], (struct rect *)rect)) {
+            mask |= (uint64_t)1 << i;
+        }
+    }
+    return mask;
+}
+
+// rects_intersects_mask for points stored as DIMS coordinates each
+static uint64_t points_within_mask_scalar(const NUMTYPE *points, int count, const struct rect *rect) {
+    uint64_t mask = 0;
+    for (int i = 0; i < count; i++) {
+        const NUMTYPE *point = &points[i * DIMS];
+        bool hit = true;
+        for (int d = 0; d < DIMS; d++) {
+            hit &= !(point[d] < rect->min[d]) & !(point[d] > rect->max[d]);
+        }
+        mask |= (uint64_t)hit << i;
+    }
+    return mask;
+}
+
+#if DIMS == 2 && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RECTS_SIMD
+#include <immintrin.h>
+
+// 2-d double rects, one rect per register pair: !(min > qmax) & !(qmin > max) in both lanes
+__attribute__((target("sse2")))
+static uint64_t rects_intersects_mask_sse2(const struct rect *rects, int count, const struct rect *rect) {
+    const double *q = (const double *)rect;
+    __m128d qmin = _mm_loadu_pd(q), qmax = _mm_loadu_pd(q + 2);
+    uint64_t mask = 0;
+    for (int i = 0; i < count; i++) {
+        const double *r = (const double *)&rects[i];
+        __m128d hit = _mm_and_pd(_mm_cmpngt_pd(_mm_loadu_pd(r), qmax), _mm_cmpngt_pd(qmin, _mm_loadu_pd(r + 2)));
+        mask |= (uint64_t)(_mm_movemask_pd(hit) == 3) << i;
+    }
+    return mask;
+}
+
+// 2-d double rects, four rects per iteration transposed into min0/min1/max0/max1 registers
+__attribute__((target("avx")))
+static uint64_t rects_intersects_mask_avx(const struct rect *rects, int count, const struct rect *rect) {
+    const double *q = (const double *)rect;
+    __m256d qmin0 = _mm256_set1_pd(q[0]), qmin1 = _mm256_set1_pd(q[1]);
+    __m256d qmax0 = _mm256_set1_pd(q[2]), qmax1 = _mm256_set1_pd(q[3]);
+    uint64_t mask = 0;
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const double *r = (const double *)&rects[i];
+        __m256d r0 = _mm256_loadu_pd(r), r1 = _mm256_loadu_pd(r + 4);
+        __m256d r2 = _mm256_loadu_pd(r + 8), r3 = _mm256_loadu_pd(r + 12);
+        __m256d t0 = _mm256_unpacklo_pd(r0, r1), t1 = _mm256_unpackhi_pd(r0, r1); // min0 min0 max0 max0 / min1 min1 max1 max1
+        __m256d t2 = _mm256_unpacklo_pd(r2, r3), t3 = _mm256_unpackhi_pd(r2, r3);
+        __m256d min0 = _mm256_permute2f128_pd(t0, t2, 0x20), max0 = _mm256_permute2f128_pd(t0, t2, 0x31);
+        __m256d min1 = _mm256_permute2f128_pd(t1, t3, 0x20), max1 = _mm256_permute2f128_pd(t1, t3, 0x31);
+        __m256d hit = _mm256_and_pd(
+            _mm256_and_pd(_mm256_cmp_pd(min0, qmax0, _CMP_NGT_UQ), _mm256_cmp_pd(min1, qmax1, _CMP_NGT_UQ)),
+            _mm256_and_pd(_mm256_cmp_pd(qmin0, max0, _CMP_NGT_UQ), _mm256_cmp_pd(qmin1, max1, _CMP_NGT_UQ)));
+        mask |= (uint64_t)_mm256_movemask_pd(hit) << i;
+    }
+    if (i < count) {
+        _mm256_zeroupper(); // the tail kernel is not vex encoded, avoid the avx to sse transition stall
+        mask |= rects_intersects_mask_sse2(&rects[i], count - i, rect) << i;
+    }
+    return mask;
+}
+
+// 2-d float rects, a whole rect per register: min0 min1 max0 max1 !> qmax0 qmax1 qmin0 qmin1 with the last two lanes negated
+__attribute__((target("sse2")))
+static uint64_t rects_intersects_mask_sse2_f32(const struct rect *rects, int count, const struct rect *rect) {
+    const float *q = (const float *)rect;
+    __m128 neg = _mm_set_ps(-0.0f, -0.0f, 0.0f, 0.0f);
+    __m128 qs = _mm_xor_ps(_mm_set_ps(q[1], q[0], q[3], q[2]), neg);
+    uint64_t mask = 0;
+    for (int i = 0; i < count; i++) {
+        __m128 r = _mm_xor_ps(_mm_loadu_ps((const float *)&rects[i]), neg);
+        mask |= (uint64_t)(_mm_movemask_ps(_mm_cmpngt_ps(r, qs)) == 15) << i;
+    }
+    return mask;
+}
+
+// 2-d float rects, eight rects per iteration transposed into min0/min1/max0/max1 registers,
+// rect k and k+4 share a register so that the lanes come out in order
+__attribute__((target("avx")))
+static uint64_t rects_intersects_mask_avx_f32(const struct rect *rects, int count, const struct rect *rect) {
+    const float *q = (const float *)rect;
+    __m256 qmin0 = _mm256_set1_ps(q[0]), qmin1 = _mm256_set1_ps(q[1]);
+    __m256 qmax0 = _mm256_set1_ps(q[2]), qmax1 = _mm256_set1_ps(q[3]);
+    uint64_t mask = 0;
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const float *r = (const float *)&rects[i];
+        __m256 r0 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(r)), _mm_loadu_ps(r + 16), 1);
+        __m256 r1 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(r + 4)), _mm_loadu_ps(r + 20), 1);
+        __m256 r2 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(r + 8)), _mm_loadu_ps(r + 24), 1);
+        __m256 r3 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(r + 12)), _mm_loadu_ps(r + 28), 1);
+        __m256 t0 = _mm256_unpacklo_ps(r0, r1), t1 = _mm256_unpackhi_ps(r0, r1); // min0 min0 min1 min1 / max0 max0 max1 max1
+        __m256 t2 = _mm256_unpacklo_ps(r2, r3), t3 = _mm256_unpackhi_ps(r2, r3);
+        __m256 min0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0)), min1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+        __m256 max0 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0)), max1 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+        __m256 hit = _mm256_and_ps(
+            _mm256_and_ps(_mm256_cmp_ps(min0, qmax0, _CMP_NGT_UQ), _mm256_cmp_ps(min1, qmax1, _CMP_NGT_UQ)),
+            _mm256_and_ps(_mm256_cmp_ps(qmin0, max0, _CMP_NGT_UQ), _mm256_cmp_ps(qmin1, max1, _CMP_NGT_UQ)));
+        mask |= (uint64_t)_mm256_movemask_ps(hit) << i;
+    }
+    if (i < count) {
+        _mm256_zeroupper(); // as in rects_intersects_mask_avx
+        mask |= rects_intersects_mask_sse2_f32(&rects[i], count - i, rect) << i;
+    }
+    return mask;
+}
+
+// 2-d double points, four per iteration. both coordinates of point k come out as bits 2k and 2k + 1
+__attribute__((target("avx")))
+static uint64_t points_within_mask_avx(const NUMTYPE *points, int count, const struct rect *rect) {
+    const double *q = (const double *)rect;
+    __m256d qmin = _mm256_set_pd(q[1], q[0], q[1], q[0]), qmax = _mm256_set_pd(q[3], q[2], q[3], q[2]);
+    uint64_t mask = 0;
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const double *p = (const double *)&points[i * 2];
+        __m256d p0 = _mm256_loadu_pd(p), p1 = _mm256_loadu_pd(p + 4);
+        unsigned bits = _mm256_movemask_pd(_mm256_and_pd(_mm256_cmp_pd(qmin, p0, _CMP_NGT_UQ), _mm256_cmp_pd(p0, qmax, _CMP_NGT_UQ))) |
+            _mm256_movemask_pd(_mm256_and_pd(_mm256_cmp_pd(qmin, p1, _CMP_NGT_UQ), _mm256_cmp_pd(p1, qmax, _CMP_NGT_UQ))) << 4;
+        bits &= bits >> 1;
+        mask |= (uint64_t)((bits & 1) | (bits >> 1 & 2) | (bits >> 2 & 4) | (bits >> 3 & 8)) << i;
+    }
+    if (i < count) {
+        _mm256_zeroupper(); // the scalar kernel uses legacy sse encodings too
+        mask |= points_within_mask_scalar(&points[i * 2], count - i, rect) << i;
+    }
+    return mask;
+}
+
+// 2-d float points, four per register, same bit pairing as the double kernel
+__attribute__((target("sse2")))
+static uint64_t points_within_mask_sse2_f32(const NUMTYPE *points, int count, const struct rect *rect) {
+    const float *q = (const float *)rect;
+    __m128 qmin = _mm_set_ps(q[1], q[0], q[1], q[0]), qmax = _mm_set_ps(q[3], q[2], q[3], q[2]);
+    uint64_t mask = 0;
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const float *p = (const float *)&points[i * 2];
+        __m128 p0 = _mm_loadu_ps(p), p1 = _mm_loadu_ps(p + 4);
+        unsigned bits = _mm_movemask_ps(_mm_and_ps(_mm_cmpngt_ps(qmin, p0), _mm_cmpngt_ps(p0, qmax))) |
+            _mm_movemask_ps(_mm_and_ps(_mm_cmpngt_ps(qmin, p1), _mm_cmpngt_ps(p1, qmax))) << 4;
+        bits &= bits >> 1;
+        mask |= (uint64_t)((bits & 1) | (bits >> 1 & 2) | (bits >> 2 & 4) | (bits >> 3 & 8)) << i;
+    }
+    if (i < count) {
+        mask |= points_within_mask_scalar(&points[i * 2], count - i, rect) << i;
+    }
+    return mask;
+}
+#endif
+
+static uint64_t (*rects_intersects_mask)(const struct rect *rects, int count, const struct rect *rect) = rects_intersects_mask_scalar;
+static uint64_t (*points_within_mask)(const NUMTYPE *points, int count, const struct rect *rect) = points_within_mask_scalar;
+
+static pthread_once_t rects_kernels_once = PTHREAD_ONCE_INIT;
+
+// picks the widest kernels the cpu supports, the vector kernels handle 2-d float and double entries only.
+// runs once through rects_kernels_once, trees may be created while others are searched
+static void rects_kernels_init(void) {
+#ifdef RECTS_SIMD
+    if ((NUMTYPE)0.5 == 0) {
+        return;
+    }
+    __builtin_cpu_init();
+    if (sizeof(NUMTYPE) == sizeof(float)) {
+        if (__builtin_cpu_supports("avx")) {
+            rects_intersects_mask = rects_intersects_mask_avx_f32;
+        } else if (__builtin_cpu_supports("sse2")) {
+            rects_intersects_mask = rects_intersects_mask_sse2_f32;
+        }
+        if (__builtin_cpu_supports("sse2")) {
+            points_within_mask = points_within_mask_sse2_f32;
+        }
+    } else if (sizeof(NUMTYPE) == sizeof(double)) {
+        if (__builtin_cpu_supports("avx")) {
+            rects_intersects_mask = rects_intersects_mask_avx;
+            points_within_mask = points_within_mask_avx;
+        } else if (__builtin_cpu_supports("sse2")) {
+            rects_intersects_mask = rects_intersects_mask_sse2;
+        }
+    }
+#endif
+}
+
+// the kernels test up to 64 entries per call, wider nodes are tested a word at a time
+static struct rtree_mask rects_mask(const struct rect *rects, int count, const struct rect *rect) {
+    struct rtree_mask mask;
+    if (RTREE_MASK_WORDS == 1) {
+        mask.words[0] = rects_intersects_mask(rects, count, rect);
+        return mask;
+    }
+    for (int k = 0; k < RTREE_MASK_WORDS; k++) {
+        int n = MIN(count - k * 64, 64);
+        mask.words[k] = n > 0 ? rects_intersects_mask(&rects[k * 64], n, rect) : 0;
+    }
+    return mask;
+}
+
+static struct rtree_mask points_mask(const NUMTYPE *points, int count, const struct rect *rect) {
+    struct rtree_mask mask;
+    if (RTREE_MASK_WORDS == 1) {
+        mask.words[0] = points_within_mask(points, count, rect);
+        return mask;
+    }
+    for (int k = 0; k < RTREE_MASK_WORDS; k++) {
+        int n = MIN(count - k * 64, 64);
+        mask.words[k] = n > 0 ? points_within_mask(&points[k * 64 * DIMS], n, rect) : 0;
+    }
+    return mask;
+}
+
+static struct rtree_mask node_intersects_mask(struct node *node, struct rect *rect) {
+    return rects_mask(node->rects, node->count, rect);
+}
 
-bool nums_equal(NUMTYPE a, NUMTYPE b) {
+static bool nums_equal(NUMTYPE a, NUMTYPE b) {
     return !(a < b || a > b);
 }
 
-bool rect_onedge(struct rect *rect, struct rect *other) {
+static bool rect_onedge(struct rect *rect, struct rect *other) {
     for (int i = 0; i < DIMS; i++) {
         if (nums_equal(rect->min[i], other->min[i])) {
             return true;
@@ -70,7 +701,7 @@ bool rect_onedge(struct rect *rect, struct rect *other) {
     return false;
 }
 
-bool rect_equals(struct rect *rect, struct rect *other) {
+static bool rect_equals(struct rect *rect, struct rect *other) {
     for (int i = 0; i < DIMS; i++) {
         if (!nums_equal(rect->min[i], other->min[i])) {
             return false;
@@ -82,7 +713,7 @@ bool rect_equals(struct rect *rect, struct rect *other) {
     return true;
 }
 
-void node_swap(struct node *node, int i, int j) {
+static void node_swap(struct node *node, int i, int j) {
     struct rect tmp = node->rects[i];
     node->rects[i] = node->rects[j];
     node->rects[j] = tmp;
@@ -97,7 +728,7 @@ void node_swap(struct node *node, int i, int j) {
     }
 }
 
-void node_qsort(struct node *node, int s, int e, int axis, bool rev, bool max) {
+static void node_qsort(struct node *node, int s, int e, int axis, bool rev, bool max) {
     int nrects = e - s, left = 0, right = nrects - 1, pivot = nrects / 2;
     if (nrects < 2) { return; }
     node_swap(node, s + pivot, s + right);
@@ -140,15 +771,15 @@ void node_qsort(struct node *node, int s, int e, int axis, bool rev, bool max) {
     node_qsort(node, s + left + 1, e, axis, rev, max);
 }
 
-void node_sort(struct node *node) {
+static void node_sort(struct node *node) {
     node_qsort(node, 0, node->count, 0, false, false);
 }
 
-void node_sort_by_axis(struct node *node, int axis, bool rev, bool max) {
+static void node_sort_by_axis(struct node *node, int axis, bool rev, bool max) {
     node_qsort(node, 0, node->count, axis, rev, max);
 }
 
-int rect_largest_axis(struct rect *rect) {
+static int rect_largest_axis(struct rect *rect) {
     int axis = 0;
     double nlength = (double)rect->max[0] - (double)rect->min[0];
     for (int i = 1; i < DIMS; i++) {
@@ -161,7 +792,7 @@ int rect_largest_axis(struct rect *rect) {
     return axis;
 }
 
-void node_move_rect_at_index_into(struct node *from, int index, struct node *into) {
+static void node_move_rect_at_index_into(struct node *from, int index, struct node *into) {
     into->rects[into->count] = from->rects[index];
     from->rects[index] = from->rects[from->count - 1];
     if (from->kind == LEAF) {
@@ -170,12 +801,14 @@ void node_move_rect_at_index_into(struct node *from, int index, struct node *int
     } else {
         into->children[into->count] = from->children[index];
         from->children[index] = from->children[from->count - 1];
+        into->total += node_total(into->children[into->count]);
+        from->total -= node_total(into->children[into->count]);
     }
     from->count--;
     into->count++;
 }
 
-struct node *node_split_largest_axis_edge_snap(struct rtree *tr, struct rect *rect, struct node *left) {
+static struct node *node_split_largest_axis_edge_snap(struct rtree *tr, struct rect *rect, struct node *left) {
     int axis = rect_largest_axis(rect);
     struct node *right = node_new(tr, left->kind);
     if (!right) return NULL;
@@ -205,20 +838,25 @@ struct node *node_split_largest_axis_edge_snap(struct rtree *tr, struct rect *re
     return right;
 }
 
-struct node *node_split(struct rtree *tr, struct rect *r, struct node *left) {
-    return node_split_largest_axis_edge_snap(tr, r, left);
+static double rect_margin(struct rect *rect) {
+    double margin = 0;
+    for (int i = 0; i < DIMS; i++) {
+        margin += (double)rect->max[i] - (double)rect->min[i];
+    }
+    return margin;
 }
 
-int node_rsearch(struct node *node, NUMTYPE key) {
-    for (int i = 0; i < node->count; i++) {
-        if (!(node->rects[i].min[0] < key)) {
-            return i;
-        }
+static double rect_overlap_area(const struct rect *rect, const struct rect *other) {
+    double area = 1;
+    for (int i = 0; i < DIMS; i++) {
+        double lo = (double)MAX(rect->min[i], other->min[i]), hi = (double)MIN(rect->max[i], other->max[i]);
+        if (!(hi > lo)) { return 0; }
+        area *= hi - lo;
     }
-    return node->count;
+    return area;
 }
 
-double rect_unioned_area(struct rect *rect, struct rect *other) {
+static double rect_unioned_area(struct rect *rect, struct rect *other) {
     double area = (double)MAX(rect->max[0], other->max[0]) - (double)MIN(rect->min[0], other->min[0]);
     for (int i = 1; i < DIMS; i++) {
         area *= (double)MAX(rect->max[i], other->max[i]) - (double)MIN(rect->min[i], other->min[i]);
@@ -226,7 +864,171 @@ double rect_unioned_area(struct rect *rect, struct rect *other) {
     return area; // returns the area of two rects expanded
 }
 
-int node_choose_least_enlargement(struct node *node, struct rect *ir) {
+// moves the entries marked in group to a new right node, lower indexes are pulled from the end so walk down
+static struct node *node_split_by_group(struct rtree *tr, struct node *left, bool *group) {
+    struct node *right = node_new(tr, left->kind);
+    if (!right) return NULL;
+    for (int i = left->count - 1; i >= 0; i--) {
+        if (group[i]) {
+            node_move_rect_at_index_into(left, i, right);
+        }
+    }
+    node_sort(right);
+    node_sort(left);
+    return right;
+}
+
+#define SPLIT_MIN_ENTRIES ((MAX_ENTRIES * 4 + 9) / 10) // per side, 40% as in the r* paper. min entries lets small fanouts split off single entries
+
+// guttman's quadratic split: the two entries wasting the most area together seed the groups,
+// then the entry with the strongest preference joins the group it enlarges least, until all are placed
+static struct node *node_split_quadratic(struct rtree *tr, struct node *left) {
+    int count = left->count, seeds[2] = { 0, 1 };
+    double worst = 0;
+    for (int i = 0; i < count; i++) {
+        for (int j = i + 1; j < count; j++) {
+            double waste = rect_unioned_area(&left->rects[i], &left->rects[j]) - rect_area(&left->rects[i]) - rect_area(&left->rects[j]);
+            if ((i == 0 && j == 1) || waste > worst) {
+                worst = waste;
+                seeds[0] = i;
+                seeds[1] = j;
+            }
+        }
+    }
+    bool group[MAX_ENTRIES], placed[MAX_ENTRIES] = { false };
+    struct rect grect[2] = { left->rects[seeds[0]], left->rects[seeds[1]] };
+    int gcount[2] = { 1, 1 };
+    for (int g = 0; g < 2; g++) {
+        group[seeds[g]] = g;
+        placed[seeds[g]] = true;
+    }
+    for (int remaining = count - 2; remaining > 0; remaining--) {
+        int g = -1;
+        if (gcount[0] + remaining <= SPLIT_MIN_ENTRIES) { g = 0; } // the group needs everything left to reach min entries
+        if (gcount[1] + remaining <= SPLIT_MIN_ENTRIES) { g = 1; }
+        int next = -1;
+        double nextdiff = -1, enl[2] = { 0 };
+        for (int i = 0; i < count; i++) {
+            if (placed[i]) { continue; }
+            double e0 = rect_unioned_area(&grect[0], &left->rects[i]) - rect_area(&grect[0]);
+            double e1 = rect_unioned_area(&grect[1], &left->rects[i]) - rect_area(&grect[1]);
+            double diff = e0 > e1 ? e0 - e1 : e1 - e0;
+            if (diff > nextdiff) {
+                next = i;
+                nextdiff = diff;
+                enl[0] = e0;
+                enl[1] = e1;
+            }
+        }
+        if (g == -1) {
+            if (enl[0] != enl[1]) {
+                g = enl[0] < enl[1] ? 0 : 1;
+            } else if (rect_area(&grect[0]) != rect_area(&grect[1])) {
+                g = rect_area(&grect[0]) < rect_area(&grect[1]) ? 0 : 1;
+            } else {
+                g = gcount[0] <= gcount[1] ? 0 : 1;
+            }
+        }
+        group[next] = g;
+        placed[next] = true;
+        rect_expand(&grect[g], &left->rects[next]);
+        gcount[g]++;
+    }
+    return node_split_by_group(tr, left, group);
+}
+
+struct split_distribution {
+    int k;              // entries that stay left
+    double overlap;
+    double area;
+};
+
+// walks all distributions of the node in its current order that leave both sides with split min entries,
+// adds their margins to *margin and keeps the one with the least overlap, then least area, in *best
+static void node_split_distributions(struct node *node, double *margin, struct split_distribution *best) {
+    struct rect pre[MAX_ENTRIES], suf[MAX_ENTRIES]; // bounding rects of entries [0..k] and [k..count)
+    int count = node->count;
+    pre[0] = node->rects[0];
+    for (int k = 1; k < count; k++) {
+        pre[k] = pre[k - 1];
+        rect_expand(&pre[k], &node->rects[k]);
+    }
+    suf[count - 1] = node->rects[count - 1];
+    for (int k = count - 2; k >= 0; k--) {
+        suf[k] = suf[k + 1];
+        rect_expand(&suf[k], &node->rects[k]);
+    }
+    for (int k = SPLIT_MIN_ENTRIES; k <= count - SPLIT_MIN_ENTRIES; k++) {
+        *margin += rect_margin(&pre[k - 1]) + rect_margin(&suf[k]);
+        double overlap = rect_overlap_area(&pre[k - 1], &suf[k]);
+        double area = rect_area(&pre[k - 1]) + rect_area(&suf[k]);
+        if (best->k == 0 || overlap < best->overlap || (!(overlap > best->overlap) && area < best->area)) {
+            best->k = k;
+            best->overlap = overlap;
+            best->area = area;
+        }
+    }
+}
+
+// r*-tree split: the axis with the smallest margin sum over all distributions, then the distribution
+// along it with the least overlap between the two halves
+static struct node *node_split_rstar(struct rtree *tr, struct node *left) {
+    int axis = 0;
+    double axis_margin = 0;
+    for (int i = 0; i < DIMS; i++) {
+        double margin = 0;
+        struct split_distribution unused = { 0 };
+        node_sort_by_axis(left, i, false, false);
+        node_split_distributions(left, &margin, &unused);
+        node_sort_by_axis(left, i, false, true);
+        node_split_distributions(left, &margin, &unused);
+        if (i == 0 || margin < axis_margin) {
+            axis = i;
+            axis_margin = margin;
+        }
+    }
+    struct split_distribution by_min = { 0 }, by_max = { 0 };
+    double margin = 0;
+    node_sort_by_axis(left, axis, false, true);
+    node_split_distributions(left, &margin, &by_max);
+    node_sort_by_axis(left, axis, false, false);
+    node_split_distributions(left, &margin, &by_min);
+    int k = by_min.k;
+    if (by_max.overlap < by_min.overlap || (!(by_max.overlap > by_min.overlap) && by_max.area < by_min.area)) {
+        node_sort_by_axis(left, axis, false, true);
+        k = by_max.k;
+    }
+    if (k == 0) { k = left->count / 2; } // fewer than 2 * split min entries
+    struct node *right = node_new(tr, left->kind);
+    if (!right) return NULL;
+    while (left->count > k) {
+        node_move_rect_at_index_into(left, left->count - 1, right);
+    }
+    node_sort(right);
+    node_sort(left);
+    return right;
+}
+
+static struct node *node_split(struct rtree *tr, struct rect *r, struct node *left) {
+    STAT(tr, splits, 1);
+    if (tr->split == RTREE_SPLIT_QUADRATIC) {
+        return node_split_quadratic(tr, left);
+    } else if (tr->split == RTREE_SPLIT_RSTAR) {
+        return node_split_rstar(tr, left);
+    }
+    return node_split_largest_axis_edge_snap(tr, r, left);
+}
+
+static int node_rsearch(struct node *node, NUMTYPE key) {
+    for (int i = 0; i < node->count; i++) {
+        if (!(node->rects[i].min[0] < key)) {
+            return i;
+        }
+    }
+    return node->count;
+}
+
+static int node_choose_least_enlargement(struct node *node, struct rect *ir) {
     int j = -1;
     double jenlargement = 0, jarea = 0;
     for (int i = 0; i < node->count; i++) {
@@ -243,11 +1045,48 @@ int node_choose_least_enlargement(struct node *node, struct rect *ir) {
     return j;
 }
 
-int node_choose_subtree(struct node *node, struct rect *ir) {
+#define RSTAR_CANDIDATES 16 // entries with the least area enlargement that get their overlap computed
+
+// r*-tree choice for nodes whose children are leaves: the least overlap enlargement with the siblings,
+// then the least area enlargement. only the candidates enlarging the area least are considered
+static int node_choose_least_overlap(struct node *node, struct rect *ir) {
+    double enl[MAX_ENTRIES];
+    bool candidate[MAX_ENTRIES] = { false };
+    for (int i = 0; i < node->count; i++) {
+        enl[i] = rect_unioned_area(&node->rects[i], ir) - rect_area(&node->rects[i]);
+    }
+    for (int c = 0; c < MIN(RSTAR_CANDIDATES, node->count); c++) {
+        int j = -1;
+        for (int i = 0; i < node->count; i++) {
+            if (!candidate[i] && (j == -1 || enl[i] < enl[j])) { j = i; }
+        }
+        candidate[j] = true;
+    }
+    int j = -1;
+    double joverlap = 0;
+    for (int i = 0; i < node->count; i++) {
+        if (!candidate[i]) { continue; }
+        struct rect grown = node->rects[i];
+        rect_expand(&grown, ir);
+        double overlap = 0;
+        for (int k = 0; k < node->count; k++) {
+            if (k != i && rect_intersects(&grown, &node->rects[k])) {
+                overlap += rect_overlap_area(&grown, &node->rects[k]) - rect_overlap_area(&node->rects[i], &node->rects[k]);
+            }
+        }
+        if (j == -1 || overlap < joverlap || (!(overlap > joverlap) && enl[i] < enl[j])) {
+            j = i;
+            joverlap = overlap;
+        }
+    }
+    return j;
+}
+
+static int node_choose_subtree(struct rtree *tr, struct node *node, struct rect *ir) {
     // take a quick look for the first node that contain the rect.
-    if (FAST_CHOOSER == 1) {
+    if (tr->chooser == RTREE_CHOOSE_SMALLEST_CONTAINING) {
         int index = -1;
-        double narea;
+        double narea = 0;
         for (int i = 0; i < node->count; i++) {
             if (rect_contains(&node->rects[i], ir)) {
                 double area = rect_area(&node->rects[i]);
@@ -257,7 +1096,14 @@ int node_choose_subtree(struct node *node, struct rect *ir) {
                 }
             }
         }
-    } else if (FAST_CHOOSER == 2) {
+        if (index != -1) {
+            return index;
+        }
+    } else if (tr->chooser == RTREE_CHOOSE_LEAST_OVERLAP) {
+        if (node->children[0]->kind == LEAF) {
+            return node_choose_least_overlap(node, ir);
+        }
+    } else if (tr->chooser == RTREE_CHOOSE_FIRST_CONTAINING) {
         for (int i = 0; i < node->count; i++) {
             if (rect_contains(&node->rects[i], ir)) {
                 return i;
@@ -268,7 +1114,7 @@ int node_choose_subtree(struct node *node, struct rect *ir) {
     return node_choose_least_enlargement(node, ir);
 }
 
-struct rect node_rect_calc(struct node *node) {
+static struct rect node_rect_calc(struct node *node) {
     struct rect rect = node->rects[0];
     for (int i = 1; i < node->count; i++) {
         rect_expand(&rect, &node->rects[i]);
@@ -276,7 +1122,7 @@ struct rect node_rect_calc(struct node *node) {
     return rect;
 }
 
-int node_order_to_right(struct node *node, int index) {
+static int node_order_to_right(struct node *node, int index) {
     while (index < node->count - 1 && node->rects[index + 1].min[0] < node->rects[index].min[0]) {
         node_swap(node, index + 1, index);
         index++;
@@ -284,7 +1130,7 @@ int node_order_to_right(struct node *node, int index) {
     return index;
 }
 
-int node_order_to_left(struct node *node, int index) {
+static int node_order_to_left(struct node *node, int index) {
     while (index > 0 && node->rects[index].min[0] < node->rects[index - 1].min[0]) {
         node_swap(node,index, index - 1);
         index--;
@@ -292,27 +1138,79 @@ int node_order_to_left(struct node *node, int index) {
     return index;
 }
 
+#define REINSERT_ENTRIES (MAX_ENTRIES * 30 / 100)
+
+// r*-tree forced reinsertion: moves the entries whose centers lie farthest from the center of the
+// overflowing leaf into tr->pending, they are inserted again once the current insertion is done
+static bool node_take_farthest(struct rtree *tr, struct node *node) {
+    if (!tr->pending && !(tr->pending = node_new(tr, LEAF))) {
+        return false;
+    }
+    struct rect nr = node_rect_calc(node);
+    double dist[MAX_ENTRIES];
+    for (int i = 0; i < node->count; i++) {
+        dist[i] = 0;
+        for (int j = 0; j < DIMS; j++) {
+            double d = ((double)node->rects[i].min[j] + (double)node->rects[i].max[j]) - ((double)nr.min[j] + (double)nr.max[j]);
+            dist[i] += d * d;
+        }
+    }
+    for (int n = 0; n < REINSERT_ENTRIES; n++) {
+        int far = 0;
+        for (int i = 1; i < node->count; i++) {
+            if (dist[i] > dist[far]) { far = i; }
+        }
+        dist[far] = dist[node->count - 1]; // mirror the move of the last entry into the hole
+        node_move_rect_at_index_into(node, far, tr->pending);
+    }
+    node_sort(node);
+    return true;
+}
+
 // performs a copy of the data from args[1] & args[2], expects a rectangle (double[] double[])
 // first N values are min corner, next N values - max corner, N - num of dimensions (max coords are optional)
-bool node_insert(struct rtree *tr, struct rect *nr, struct node *node, struct rect *ir, struct item item, bool *split, bool *grown) {
+static bool node_insert(struct rtree *tr, struct rect *nr, struct node *node, struct rect *ir, struct item item, bool *split, bool *grown) {
     *split = false;
     *grown = false;
+    STAT(tr, nodes_visited, 1);
     if (node->kind == LEAF) {
         if (node->count == MAX_ENTRIES) {
-            *split = true;
-            return true;
+            // once per insertion, and never for the root, the overflow is resolved by reinsertion instead of a split
+            if (!tr->reinsert || tr->reinserting || node == tr->root || REINSERT_ENTRIES == 0) {
+                *split = true;
+                return true;
+            }
+            if (!node_take_farthest(tr, node)) {
+                return false;
+            }
+            tr->reinserting = true;
         }
         int index = node_rsearch(node, ir->min[0]);
+        STAT(tr, memmove_bytes, (node->count - index) * (sizeof(struct rect) + sizeof(struct item)));
         memmove(&node->rects[index + 1], &node->rects[index], (node->count-index) * sizeof(struct rect));
         memmove(&node->items[index + 1], &node->items[index], (node->count-index) * sizeof(struct item));
         node->rects[index] = *ir;
         node->items[index] = item;
         node->count++;
-        *grown = !rect_contains(nr, ir);
+        if (tr->pending && tr->pending->count > 0) { // entries were taken out, the rect may have shrunk
+            *nr = node_rect_calc(node);
+            *grown = true;
+            return true;
+        }
+        *grown = !rect_contains(nr, ir);
         return true;
     }
-    int index = node_choose_subtree(node, ir); // choose a subtree for inserting the rectangle
-    if (!node_insert(tr, &node->rects[index], node->children[index], ir, item, split, grown)) {
+    int index = node_choose_subtree(tr, node, ir); // choose a subtree for inserting the rectangle
+    STAT(tr, rect_tests, node->count);
+    struct node *child = node_mut(tr, node->children[index]);
+    if (!child) {
+        return false;
+    }
+    node->children[index] = child;
+    size_t total = node_total(child);
+    bool ok = node_insert(tr, &node->rects[index], child, ir, item, split, grown);
+    node->total += node_total(child) - total; // forced reinsertion may have taken entries out of the subtree
+    if (!ok) {
         return false;
     }
     if (*split) {
@@ -325,6 +1223,7 @@ bool node_insert(struct rtree *tr, struct rect *nr, struct node *node, struct re
             return false;
         }
         node->rects[index] = node_rect_calc(left);
+        STAT(tr, memmove_bytes, (node->count - (index + 1)) * (sizeof(struct rect) + sizeof(struct node *)));
         memmove(&node->rects[index + 2], &node->rects[index + 1], (node->count - (index + 1)) * sizeof(struct rect));
         memmove(&node->children[index + 2], &node->children[index + 1], (node->count - (index + 1)) * sizeof(struct node*));
         node->rects[index + 1] = node_rect_calc(right);
@@ -337,6 +1236,11 @@ bool node_insert(struct rtree *tr, struct rect *nr, struct node *node, struct re
         node_order_to_right(node, index);
         return node_insert(tr, nr, node, ir, item, split, grown);
     }
+    if (*grown && tr->pending && tr->pending->count > 0) { // child rect was recalculated
+        node_order_to_right(node, node_order_to_left(node, index));
+        *nr = node_rect_calc(node);
+        return true;
+    }
     if (*grown) { // child rectangle must expand to accomadate new item
         rect_expand(&node->rects[index], ir);
         node_order_to_left(node, index);
@@ -345,177 +1249,3422 @@ bool node_insert(struct rtree *tr, struct rect *nr, struct node *node, struct re
     return true;
 }
 
+// entry of a level being packed by bulk loading: an item at the leaf level, a child node above it
+struct bulk_entry {
+    struct rect rect;
+    union { struct item item; struct node *child; size_t index; };
+    uint64_t key;       // hilbert key, the largest one of the subtree for a child
+};
+
+#define HILBERT_BITS (64 / DIMS < 32 ? 64 / DIMS : 32) // grid resolution per dimension of the keys in hilbert mode
+#define HILBERT_BATCH_BITS (HILBERT_BITS < 10 ? HILBERT_BITS : 10) // coarser grid for ordering a batch, ample for grouping
+
+// position of the rect center on the hilbert curve through the bounds, on a grid of 2^bits cells per dimension.
+// skilling's transpose algorithm
+static uint64_t hilbert_key(const struct rect *bounds, const struct rect *rect, int bits) {
+    uint32_t x[DIMS];
+    for (int i = 0; i < DIMS; i++) {
+        double span = (double)bounds->max[i] - (double)bounds->min[i];
+        double t = span > 0 ? (((double)rect->min[i] + (double)rect->max[i]) / 2 - (double)bounds->min[i]) / span : 0;
+        x[i] = (uint32_t)(MIN(MAX(t, 0), 1) * (double)((UINT64_C(1) << bits) - 1));
+    }
+    for (uint32_t q = UINT32_C(1) << (bits - 1); q > 1; q >>= 1) {
+        uint32_t p = q - 1;
+        for (int i = 0; i < DIMS; i++) { // branch free, the bit is a coin flip
+            uint32_t set = 0 - ((x[i] & q) != 0);
+            uint32_t t = (x[0] ^ x[i]) & p & ~set;
+            x[0] ^= (p & set) | t;
+            x[i] ^= t;
+        }
+    }
+    for (int i = 1; i < DIMS; i++) {
+        x[i] ^= x[i - 1];
+    }
+    uint32_t t = 0;
+    for (uint32_t q = UINT32_C(1) << (bits - 1); q > 1; q >>= 1) {
+        t ^= (q - 1) & (0 - ((x[DIMS - 1] & q) != 0));
+    }
+    uint64_t key = 0;
+    for (int b = bits - 1; b >= 0; b--) {
+        for (int i = 0; i < DIMS; i++) {
+            key = (key << 1) | (((x[i] ^ t) >> b) & 1);
+        }
+    }
+    return key;
+}
+
+struct hilbert_entry {
+    uint64_t key;
+    size_t index;
+};
+
+// orders the entries along the hilbert curve through bounds and stores their keys, byte-wise radix sort of the
+// keys. tmp has room for n
+static bool hilbert_sort_in(struct rtree *tr, const struct rect *bounds, int bits, struct bulk_entry *entries, struct bulk_entry *tmp, size_t n) {
+    struct hilbert_entry *keys = (struct hilbert_entry *)tr->malloc(2 * n * sizeof(struct hilbert_entry));
+    if (!keys) { return false; }
+    for (size_t i = 0; i < n; i++) {
+        keys[i].key = hilbert_key(bounds, &entries[i].rect, bits);
+        keys[i].index = i;
+    }
+    struct hilbert_entry *from = keys, *to = keys + n;
+    for (int shift = 0; shift < bits * DIMS; shift += 8) {
+        size_t counts[257] = { 0 };
+        for (size_t i = 0; i < n; i++) {
+            counts[((from[i].key >> shift) & 0xff) + 1]++;
+        }
+        if (counts[((from[0].key >> shift) & 0xff) + 1] == n) { // every key has the same byte here
+            continue;
+        }
+        for (int d = 0; d < 256; d++) {
+            counts[d + 1] += counts[d];
+        }
+        for (size_t i = 0; i < n; i++) {
+            to[counts[(from[i].key >> shift) & 0xff]++] = from[i];
+        }
+        struct hilbert_entry *swap = from;
+        from = to;
+        to = swap;
+    }
+    for (size_t i = 0; i < n; i++) {
+        tmp[i] = entries[from[i].index];
+        tmp[i].key = from[i].key;
+    }
+    memcpy(entries, tmp, n * sizeof(struct bulk_entry));
+    tr->free(keys);
+    return true;
+}
+
+// in hilbert mode the keys are those of the tree, otherwise the curve runs through the bounds of the entries
+static bool hilbert_sort(struct rtree *tr, struct bulk_entry *entries, struct bulk_entry *tmp, size_t n) {
+    struct rect bounds = tr->hilbert ? tr->frame : entries[0].rect;
+    for (size_t i = 1; !tr->hilbert && i < n; i++) {
+        rect_expand(&bounds, &entries[i].rect);
+    }
+    return hilbert_sort_in(tr, &bounds, tr->hilbert ? HILBERT_BITS : HILBERT_BATCH_BITS, entries, tmp, n);
+}
+
+// largest key of the subtree, what the parent stores for the node in hilbert mode
+static uint64_t node_key(struct node *node) {
+    return node->keys[node->count - 1];
+}
+
+// index of the first entry whose key is not below key, entries are in key order in hilbert mode
+static int node_key_search(struct node *node, uint64_t key) {
+    int lo = 0, hi = node->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (node->keys[mid] < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// copies n entries starting at index of one node to position at of another, or of the same node.
+// the keys come along in hilbert mode
+static void node_copy_entries(struct rtree *tr, struct node *into, int at, struct node *from, int index, int n) {
+    memmove(&into->rects[at], &from->rects[index], n * sizeof(struct rect));
+    if (from->kind == LEAF) {
+        memmove(&into->items[at], &from->items[index], n * sizeof(struct item));
+    } else {
+        memmove(&into->children[at], &from->children[index], n * sizeof(struct node *));
+        for (int i = 0; i < n && into != from; i++) { // the subtrees change hands
+            into->total += node_total(into->children[at + i]);
+            from->total -= node_total(into->children[at + i]);
+        }
+    }
+    if (tr->hilbert) {
+        memmove(&into->keys[at], &from->keys[index], n * sizeof(uint64_t));
+    }
+}
+
+// appends n entries of a level being packed to the node
+static void node_fill(struct rtree *tr, struct node *node, const struct bulk_entry *entries, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        node->rects[node->count] = entries[i].rect;
+        if (node->kind == LEAF) {
+            node->items[node->count] = entries[i].item;
+        } else {
+            node->children[node->count] = entries[i].child;
+            node->total += node_total(entries[i].child);
+        }
+        if (tr->hilbert) {
+            node->keys[node->count] = entries[i].key;
+        }
+        node->count++;
+    }
+}
+
+// deferred splitting of the full child at index in hilbert mode: the entries of the child and a neighbour are
+// spread evenly over both when the neighbour has room, over three nodes when it has none. a lone child is split
+// in two. *full is set instead when the node has no room for another child
+static bool node_spread(struct rtree *tr, struct node *node, int index, bool *full) {
+    int first = MIN(index, MAX(node->count - 2, 0)), count = MIN(node->count, 2), total = 0;
+    for (int i = first; i < first + count; i++) {
+        total += node->children[i]->count;
+    }
+    int nodes = count == 2 && total <= 2 * (MAX_ENTRIES - 1) ? 2 : count + 1; // every node ends up with room
+    *full = nodes > count && node->count == MAX_ENTRIES;
+    if (*full) {
+        return true;
+    }
+    struct node *parts[3];
+    for (int i = 0; i < count; i++) {
+        if (!(parts[i] = node_mut(tr, node->children[first + i]))) {
+            return false;
+        }
+        node->children[first + i] = parts[i];
+    }
+    if (nodes > count) {
+        if (!(parts[count] = node_new(tr, parts[0]->kind))) {
+            return false;
+        }
+        STAT(tr, splits, 1);
+        node_copy_entries(tr, node, first + count + 1, node, first + count, node->count - (first + count));
+        node->children[first + count] = parts[count];
+        node->count++;
+    }
+    struct bulk_entry entries[2 * MAX_ENTRIES];
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < parts[i]->count; j++, n++) {
+            entries[n].rect = parts[i]->rects[j];
+            if (parts[i]->kind == LEAF) {
+                entries[n].item = parts[i]->items[j];
+            } else {
+                entries[n].child = parts[i]->children[j];
+            }
+            entries[n].key = parts[i]->keys[j];
+        }
+        parts[i]->count = 0;
+        parts[i]->total = 0;
+    }
+    for (int i = 0; i < nodes; i++) {
+        int s = total * i / nodes, e = total * (i + 1) / nodes;
+        node_fill(tr, parts[i], &entries[s], e - s);
+        node->rects[first + i] = node_rect_calc(parts[i]);
+        node->keys[first + i] = node_key(parts[i]);
+    }
+    return true;
+}
+
+// hilbert mode insertion: the entry goes to the first child whose largest key is not below its own, or the last
+// child, and into the leaf in key order. a full leaf sets *split, its parent spreads it and tries again
+static bool node_insert_hilbert(struct rtree *tr, struct rect *nr, struct node *node, struct rect *ir, struct item item, uint64_t key, bool *split, bool *grown) {
+    *split = false;
+    *grown = false;
+    STAT(tr, nodes_visited, 1);
+    int index = node_key_search(node, key);
+    if (node->kind == LEAF) {
+        if (node->count == MAX_ENTRIES) {
+            *split = true;
+            return true;
+        }
+        STAT(tr, memmove_bytes, (node->count - index) * (sizeof(struct rect) + sizeof(struct item) + sizeof(uint64_t)));
+        node_copy_entries(tr, node, index + 1, node, index, node->count - index);
+        node->rects[index] = *ir;
+        node->items[index] = item;
+        node->keys[index] = key;
+        node->count++;
+        *grown = !rect_contains(nr, ir);
+        return true;
+    }
+    index = MIN(index, node->count - 1);
+    struct node *child = node_mut(tr, node->children[index]);
+    if (!child) {
+        return false;
+    }
+    node->children[index] = child;
+    size_t total = node_total(child);
+    bool ok = node_insert_hilbert(tr, &node->rects[index], child, ir, item, key, split, grown);
+    node->total += node_total(child) - total;
+    if (!ok) {
+        return false;
+    }
+    if (*split) {
+        if (!node_spread(tr, node, index, split)) {
+            return false;
+        }
+        return *split || node_insert_hilbert(tr, nr, node, ir, item, key, split, grown);
+    }
+    node->keys[index] = MAX(node->keys[index], key);
+    if (*grown) {
+        rect_expand(&node->rects[index], ir);
+        *grown = !rect_contains(nr, ir);
+    }
+    return true;
+}
+
 struct rtree *rtree_new_with_allocator(void *(*cust_malloc)(size_t), void (*cust_free)(void*)) {
     if (!cust_malloc) cust_malloc = malloc;
     if (!cust_free) cust_free = free;
+    pthread_once(&rects_kernels_once, rects_kernels_init);
     struct rtree *tr = (struct rtree *)cust_malloc(sizeof(struct rtree));
     if (!tr) { return NULL; }
     memset(tr, 0, sizeof(struct rtree));
     tr->malloc = cust_malloc;
     tr->free = cust_free;
+    tr->pool = pool_new(tr);
+    if (!tr->pool) {
+        cust_free(tr);
+        return NULL;
+    }
+    tr->split = RTREE_SPLIT_EDGE_SNAP;
+    tr->chooser = FAST_CHOOSER;
+    pthread_mutex_init(&tr->lock, NULL);
     return tr;
 }
 
 struct rtree *rtree_new() { return rtree_new_with_allocator(NULL, NULL); }
 
-bool rtree_insert(struct rtree *tr, const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data) {
-    struct rect rect;
-    memcpy(&rect.min[0], min, sizeof(NUMTYPE) * DIMS);
-    memcpy(&rect.max[0], max ? max : min, sizeof(NUMTYPE) * DIMS);
-    struct item item;
-    memcpy(&item.data, &data, sizeof(DATATYPE));
+// selects the split algorithm along with the subtree choice it is designed for, RTREE_SPLIT_RSTAR also turns
+// on forced reinsertion. the fields can be changed individually afterwards to compare combinations
+void rtree_set_split(struct rtree *tr, enum rtree_split split) {
+    tr->split = split;
+    tr->chooser = split == RTREE_SPLIT_RSTAR ? RTREE_CHOOSE_LEAST_OVERLAP :
+                  split == RTREE_SPLIT_QUADRATIC ? RTREE_CHOOSE_LEAST_ENLARGEMENT : FAST_CHOOSER;
+    tr->reinsert = split == RTREE_SPLIT_RSTAR;
+}
+
+// pins the root published to readers, nodes retired from now on stay alive until reader_unlock
+static struct node *reader_lock(struct rtree *tr, int *slot) {
+    if (!tr->concurrent) {
+        *slot = -1;
+        return tr->root;
+    }
+    for (;;) {
+        unsigned epoch = __atomic_load_n(&tr->epoch, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&tr->readers[epoch & 1], 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&tr->epoch, __ATOMIC_SEQ_CST) == epoch) {
+            *slot = epoch & 1;
+            return __atomic_load_n(&tr->shared, __ATOMIC_ACQUIRE);
+        }
+        __atomic_sub_fetch(&tr->readers[epoch & 1], 1, __ATOMIC_SEQ_CST); // the writer moved on, retry
+    }
+}
+
+static void reader_unlock(struct rtree *tr, int slot) {
+    if (slot >= 0) {
+        __atomic_sub_fetch(&tr->readers[slot], 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+static void writer_lock(struct rtree *tr) {
+    if (tr->concurrent) {
+        pthread_mutex_lock(&tr->lock);
+    }
+}
+
+static void limbo_free(struct rtree *tr, struct node_list *limbo) {
+    for (size_t i = 0; i < limbo->len; i++) {
+        node_free(tr, limbo->nodes[i]);
+    }
+    limbo->len = 0;
+}
+
+// frees what was retired in the previous epoch once its readers are gone, then moves the
+// readers to a new epoch so the nodes retired in the current one can follow
+static void rtree_reclaim(struct rtree *tr) {
+    if (tr->draining) {
+        unsigned prev = (tr->epoch - 1) & 1;
+        if (__atomic_load_n(&tr->readers[prev], __ATOMIC_SEQ_CST) > 0) {
+            return;
+        }
+        limbo_free(tr, &tr->limbo[prev]);
+        tr->draining = false;
+    }
+    if (tr->limbo[tr->epoch & 1].len > 0) {
+        __atomic_store_n(&tr->epoch, tr->epoch + 1, __ATOMIC_SEQ_CST);
+        tr->draining = true;
+    }
+}
+
+// publishes the writer's root and closes its generation, everything reachable is immutable from now on
+static void writer_unlock(struct rtree *tr) {
+    if (!tr->concurrent) {
+        return;
+    }
+    __atomic_store_n(&tr->shared, tr->root, __ATOMIC_RELEASE);
+    tr->gen++;
+    rtree_reclaim(tr);
+    pthread_mutex_unlock(&tr->lock);
+}
+
+// in concurrent mode searches run without locks against the last published root, while a single
+// writer at a time copies the root-to-leaf paths it modifies. must be called while no other thread uses the tree
+void rtree_set_concurrent(struct rtree *tr, bool concurrent) {
+    if (tr->map) { return; } // mapped trees never change
+    if (!concurrent) { // no readers are left, everything retired can go
+        limbo_free(tr, &tr->limbo[0]);
+        limbo_free(tr, &tr->limbo[1]);
+        tr->draining = false;
+    }
+    tr->concurrent = concurrent;
+    tr->shared = tr->root;
+    tr->gen++;
+}
+
+// hilbert r-tree mode: the entries of every node are ordered by the hilbert key of their center within the frame
+// from min to max instead of by min[0]. full nodes share their entries with a neighbour and are split 2-to-3, so
+// leaves stay spatially coherent and fuller, and the bulk loader lays out neighbouring leaves next to each other.
+// rects outside the frame are clamped onto its border, the split algorithm and subtree choice are not used.
+// only for an empty tree, NULL turns the mode off. must be called while no other thread uses the tree
+bool rtree_set_hilbert(struct rtree *tr, const NUMTYPE *min, const NUMTYPE *max) {
+    if (tr->map || tr->root || pool_shared(tr)) { return false; }
+    bool hilbert = min != NULL;
+    if (hilbert) {
+        memcpy(&tr->frame.min[0], min, sizeof(NUMTYPE) * DIMS);
+        memcpy(&tr->frame.max[0], max ? max : min, sizeof(NUMTYPE) * DIMS);
+    }
+    if (hilbert == tr->hilbert) { return true; }
+    tr->hilbert = hilbert;
+    struct node_pool *pool = pool_new(tr); // nodes change size along with the mode
+    if (!pool) {
+        tr->hilbert = !hilbert;
+        return false;
+    }
+    limbo_free(tr, &tr->limbo[0]);
+    limbo_free(tr, &tr->limbo[1]);
+    tr->draining = false;
+    pool_free(tr, tr->pool);
+    tr->pool = pool;
+    tr->pending = NULL; // lived in the old pool
+    return true;
+}
+
+static bool tree_insert(struct rtree *tr, struct rect *rect, struct item item) {
     if (!tr->root) {
         struct node *new_root = node_new(tr, LEAF);
         if (!new_root) return false;
         tr->root = new_root;
-        tr->rect = rect;
+        tr->rect = *rect;
     }
+    struct node *root = node_mut(tr, tr->root);
+    if (!root) return false;
+    tr->root = root;
     bool split = false, grown = false;
-    if (!node_insert(tr, &tr->rect, tr->root, &rect, item, &split, &grown)) { return false; }
+    if (tr->hilbert) {
+        uint64_t key = hilbert_key(&tr->frame, rect, HILBERT_BITS);
+        if (!node_insert_hilbert(tr, &tr->rect, tr->root, rect, item, key, &split, &grown)) { return false; }
+    } else if (!node_insert(tr, &tr->rect, tr->root, rect, item, &split, &grown)) {
+        return false;
+    }
+    if (split && tr->hilbert) { // the root becomes the lone child of a new root, which spreads it over two nodes
+        struct node *new_root = node_new(tr, BRANCH);
+        if (!new_root) return false;
+        new_root->rects[0] = tr->rect;
+        new_root->children[0] = tr->root;
+        new_root->keys[0] = node_key(tr->root);
+        new_root->total = node_total(tr->root);
+        new_root->count = 1;
+        if (!node_spread(tr, new_root, 0, &split)) {
+            new_root->count = 0;
+            node_free(tr, new_root);
+            return false;
+        }
+        tr->root = new_root;
+        tr->height++;
+        return tree_insert(tr, rect, item);
+    }
     if (split) {
         struct node *new_root = node_new(tr, BRANCH);
         if (!new_root) return false;
         struct node *left = tr->root;
         struct node *right = node_split(tr, &tr->rect, left);
+        if (!right) {
+            node_free(tr, new_root);
+            return false;
+        }
         tr->root = new_root;
         tr->root->rects[0] = node_rect_calc(left);
         tr->root->rects[1] = node_rect_calc(right);
         tr->root->children[0] = left;
         tr->root->children[1] = right;
+        tr->root->total = node_total(left) + node_total(right);
         tr->root->count = 2;
         tr->height++;
         node_sort(tr->root);
-        return rtree_insert(tr, min, max, data);
+        return tree_insert(tr, rect, item);
     }
     if (grown) {
-        rect_expand(&tr->rect, &rect);
-        node_sort(tr->root);
+        rect_expand(&tr->rect, rect);
+        if (!tr->hilbert) {
+            node_sort(tr->root);
+        }
     }
     tr->count++;
+    if (tr->pending && tr->pending->count > 0) { // forced reinsertion, the entries are already counted
+        struct rect rects[REINSERT_ENTRIES + 1];
+        struct item items[REINSERT_ENTRIES + 1];
+        int n = tr->pending->count;
+        memcpy(rects, tr->pending->rects, n * sizeof(struct rect));
+        memcpy(items, tr->pending->items, n * sizeof(struct item));
+        tr->pending->count = 0;
+        tr->count -= n;
+        bool ok = true;
+        for (int i = 0; i < n; i++) {
+            ok = tree_insert(tr, &rects[i], items[i]) && ok;
+        }
+        tr->reinserting = false;
+        return ok;
+    }
     return true;
 }
 
-void rtree_free(struct rtree *tr) {
-    if (tr->root) { node_free(tr, tr->root); }
-    tr->free(tr);
+bool rtree_insert(struct rtree *tr, const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data) {
+    struct rect rect;
+    memcpy(&rect.min[0], min, sizeof(NUMTYPE) * DIMS);
+    memcpy(&rect.max[0], max ? max : min, sizeof(NUMTYPE) * DIMS);
+    struct item item;
+    memcpy(&item.data, &data, sizeof(DATATYPE));
+    if (tr->map) { return false; } // mapped trees are read-only
+    writer_lock(tr);
+    bool ok = tree_insert(tr, &rect, item);
+    writer_unlock(tr);
+    return ok;
 }
 
-bool node_search(struct node *node, struct rect *rect, bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data, void *udata), void *udata) {
-    if (node->kind == LEAF) {
-        for (int i = 0; i < node->count; i++) {
-            if (rect_intersects(&node->rects[i], rect)) {
-                if (!iter(node->rects[i].min, node->rects[i].max, node->items[i].data, udata)) {
-                    return false;
-                }
-            }
+struct bulk {
+    struct rtree *tr;
+    struct bulk_entry *entries;
+    enum kind kind;     // kind of nodes built at the current level
+    size_t out;         // number of nodes packed so far, stored in entries[0..out)
+    size_t next;        // first entry that is not yet owned by a packed node
+};
+
+static double bulk_center(struct bulk_entry *entry, int axis) {
+    return (double)entry->rect.min[axis] + (double)entry->rect.max[axis]; // doubled center, fine for ordering
+}
+
+// hoare partitioning quicksort by the center on axis, recursing into the smaller half only
+static void bulk_qsort(struct bulk_entry *entries, size_t n, int axis) {
+    while (n > 1) {
+        double pivot = bulk_center(&entries[(n - 1) / 2], axis);
+        long i = -1, j = (long)n;
+        for (;;) {
+            do { i++; } while (bulk_center(&entries[i], axis) < pivot);
+            do { j--; } while (bulk_center(&entries[j], axis) > pivot);
+            if (i >= j) { break; }
+            struct bulk_entry tmp = entries[i];
+            entries[i] = entries[j];
+            entries[j] = tmp;
         }
-        return true;
-    }
-    for (int i = 0; i < node->count; i++) {
-        if (rect_intersects(&node->rects[i], rect)) {
-            if (!node_search(node->children[i], rect, iter, udata)) {
-                return false;
-            }
+        size_t left = (size_t)j + 1;
+        if (left < n - left) {
+            bulk_qsort(entries, left, axis);
+            entries += left;
+            n -= left;
+        } else {
+            bulk_qsort(entries + left, n - left, axis);
+            n = left;
         }
     }
-    return true;
 }
 
-void rtree_search(struct rtree *tr, const NUMTYPE *min, const NUMTYPE *max, bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data, void *udata), void *udata) {
-    struct rect rect;
-    memcpy(&rect.min[0], min, sizeof(NUMTYPE) * DIMS);
-    memcpy(&rect.max[0], max ? max : min, sizeof(NUMTYPE) * DIMS);
-    if (tr->root && rect_intersects(&tr->rect, &rect)) {
-        node_search(tr->root, &rect, iter, udata);
+// smallest number of slices s such that s^k >= pages
+static size_t bulk_slices(size_t pages, int k) {
+    size_t s = 1;
+    for (;;) {
+        size_t p = 1;
+        for (int i = 0; i < k && p < pages; i++) { p *= s; }
+        if (p >= pages) { return s; }
+        s++;
     }
 }
 
-size_t rtree_count(struct rtree *tr) { return tr->count; }
+// orders the entries so that every run of group consecutive entries is spatially compact
+static void bulk_str_sort(struct bulk_entry *entries, size_t n, int axis, size_t group) {
+    bulk_qsort(entries, n, axis);
+    if (axis == DIMS - 1 || n <= group) {
+        return;
+    }
+    size_t pages = (n + group - 1) / group;
+    size_t slices = bulk_slices(pages, DIMS - axis);
+    size_t slab = (pages + slices - 1) / slices * group; // slabs end on group boundaries
+    for (size_t s = 0; s < n; s += slab) {
+        bulk_str_sort(entries + s, MIN(slab, n - s), axis + 1, group);
+    }
+}
 
-void node_delete(struct rtree *tr, struct rect *nr, struct node *node, struct rect *ir, struct item item, bool *removed, bool *shrunk, int (*compare)(const DATATYPE a, const DATATYPE b, void *udata), void *udata) {
-    *removed = false;
-    *shrunk = false;
-    if (node->kind == LEAF) {
-        for (int i = 0; i < node->count; i++) {
-            if (!rect_contains(ir, &node->rects[i])) {
-                continue;
-            }
-            int cmp = compare ?
-                compare(node->items[i].data, item.data, udata) :
-                memcmp(&node->items[i].data, &item.data, sizeof(DATATYPE));
-            if (cmp != 0) {
-                continue;
+// sort-tile-recursive packing: sort the run on axis, cut it into slabs and recurse on the next axis,
+// the last axis is cut into evenly filled nodes which are stored back into the front of entries
+static bool bulk_pack(struct bulk *b, size_t start, size_t n, int axis) {
+    bool keyed = b->tr->hilbert; // in hilbert mode the entries are in key order and cut as they are
+    if (!keyed) {
+        bulk_qsort(&b->entries[start], n, axis);
+    }
+    if (keyed || axis == DIMS - 1 || n <= MAX_ENTRIES) {
+        size_t nodes = (n + MAX_ENTRIES - 1) / MAX_ENTRIES;
+        for (size_t i = 0; i < nodes; i++) {
+            size_t s = start + n * i / nodes, e = start + n * (i + 1) / nodes;
+            struct node *node = node_new(b->tr, b->kind);
+            if (!node) { return false; }
+            node_fill(b->tr, node, &b->entries[s], e - s);
+            if (!keyed) {
+                node_sort(node);
             }
-            // found the target item to delete
-            memmove(&node->rects[i], &node->rects[i + 1], (node->count - (i + 1)) * sizeof(struct rect));
-            memmove(&node->items[i], &node->items[i + 1], (node->count - (i + 1)) * sizeof(struct item));
-            node->count--;
-            if (rect_onedge(ir, nr)) {      // item was on the edge of node rect
-                *nr = node_rect_calc(node); // recalculation of node rect
-                *shrunk = true;             // notify the caller that rect is shrunk
+            b->next = e;
+            b->entries[b->out].rect = node_rect_calc(node);
+            b->entries[b->out].child = node;
+            if (keyed) {
+                b->entries[b->out].key = node_key(node);
             }
-            *removed = true;
-            return;
+            b->out++;
         }
-        return;
+        return true;
     }
-    for (int i = 0; i < node->count; i++) {
-        if (!rect_contains(&node->rects[i], ir)) {
-            continue;
-        }
-        struct rect crect = node->rects[i];
-        node_delete(tr, &node->rects[i], node->children[i], ir, item, removed, shrunk, compare, udata);
-        if (!*removed) {
-            continue;
+    size_t pages = (n + MAX_ENTRIES - 1) / MAX_ENTRIES;
+    size_t slices = bulk_slices(pages, DIMS - axis);
+    for (size_t i = 0; i < slices; i++) {
+        size_t s = n * i / slices, e = n * (i + 1) / slices;
+        if (e > s && !bulk_pack(b, start + s, e - s, axis + 1)) {
+            return false;
         }
-        if (node->children[i]->count == 0) { // underflow
-            node_free(tr, node->children[i]);
-            memmove(&node->rects[i], &node->rects[i + 1], (node->count - (i + 1)) * sizeof(struct rect));
-            memmove(&node->children[i], &node->children[i + 1], (node->count - (i + 1)) * sizeof(struct node *));
-            node->count--;
-            *nr = node_rect_calc(node);
-            *shrunk = true;
-            return;
+    }
+    return true;
+}
+
+// packs the leaf entries into a new tree that replaces tr->root, the entries are consumed either way
+static bool bulk_build(struct rtree *tr, struct bulk_entry *entries, size_t n) {
+    if (tr->hilbert) { // the levels are cut from the entries in key order
+        struct bulk_entry *tmp = (struct bulk_entry *)tr->malloc(n * sizeof(struct bulk_entry));
+        bool sorted = tmp && hilbert_sort(tr, entries, tmp, n);
+        if (tmp) { tr->free(tmp); }
+        if (!sorted) {
+            tr->free(entries);
+            return false;
         }
-        if (*shrunk) {
-            *shrunk = !rect_equals(&node->rects[i], &crect);
-            if (*shrunk) {
-                *nr = node_rect_calc(node);
-            }
-            node_order_to_right(node, i);
+    }
+    struct bulk b = { .tr = tr, .entries = entries, .kind = LEAF };
+    size_t len = n;
+    int height = 0;
+    for (;;) {
+        b.out = 0;
+        b.next = 0;
+        if (!bulk_pack(&b, 0, len, 0)) { // out of memory, release everything packed so far
+            for (size_t i = 0; i < b.out; i++) { node_free(tr, entries[i].child); }
+            for (size_t i = b.next; b.kind == BRANCH && i < len; i++) { node_free(tr, entries[i].child); }
+            tr->free(entries);
+            return false;
         }
-        return;
+        if (b.out == 1) { break; }
+        len = b.out;
+        b.kind = BRANCH;
+        height++;
     }
-    return;
+    tr->root = entries[0].child;
+    tr->rect = entries[0].rect;
+    tr->height = height;
+    tr->count = n;
+    tr->free(entries);
+    return true;
 }
 
-// search the tree for an item contained within provided rect, perform a binary comparison of its data to provided, first item found is deleted
-void rtree_delete(struct rtree *tr, const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data) {
-    struct rect rect;
-    memcpy(&rect.min[0], min, sizeof(NUMTYPE) * DIMS);
-    memcpy(&rect.max[0], max ? max : min, sizeof(NUMTYPE) * DIMS);
-    struct item item;
-    memcpy(&item.data, &data, sizeof(DATATYPE));
-    if (!tr->root) { return; }
-    bool removed = false, shrunk = false;
-    node_delete(tr, &tr->rect, tr->root, &rect, item, &removed, &shrunk, NULL, NULL);
-    if (!removed) {
-        return;
+static bool tree_insert_batch(struct rtree *tr, const struct rect *rects, DATATYPE const *items, size_t n);
+
+static bool tree_bulk_load(struct rtree *tr, const struct rect *rects, DATATYPE const *items, size_t n) {
+    if (tr->root) {
+        return tree_insert_batch(tr, rects, items, n);
     }
-    tr->count--;
-    if (tr->count == 0) {
-        node_free(tr, tr->root);
-        tr->root = NULL;
+    struct bulk_entry *entries = (struct bulk_entry *)tr->malloc(n * sizeof(struct bulk_entry));
+    if (!entries) { return false; }
+    for (size_t i = 0; i < n; i++) {
+        entries[i].rect = rects[i];
+        memcpy(&entries[i].item.data, &items[i], sizeof(DATATYPE));
+    }
+    return bulk_build(tr, entries, n);
+}
+
+// builds the tree bottom-up from n rects at once, an already populated tree gets them as one rtree_insert_batch.
+// either way nothing is inserted when memory runs out
+bool rtree_bulk_load(struct rtree *tr, const struct rect *rects, DATATYPE const *items, size_t n) {
+    if (n == 0) { return true; }
+    if (tr->map) { return false; }
+    writer_lock(tr);
+    bool ok = tree_bulk_load(tr, rects, items, n);
+    writer_unlock(tr);
+    return ok;
+}
+
+// appends the leaf entries of the subtree at entries[n], returns the new number of entries
+static size_t node_collect(struct node *node, struct bulk_entry *entries, size_t n) {
+    for (int i = 0; i < node->count; i++) {
+        if (node->kind == LEAF) {
+            entries[n].rect = node->rects[i];
+            entries[n].item = node->items[i];
+            n++;
+        } else {
+            n = node_collect(node->children[i], entries, n);
+        }
+    }
+    return n;
+}
+
+// repacks the entries with the bulk loader. the new tree gets a pool of its own and the old one is released
+// as a whole, unless readers in concurrent mode or clones may still use the old nodes. the tree is left as it
+// was when memory runs out
+static bool tree_compact(struct rtree *tr) {
+    if (!tr->root) { return true; }
+    struct bulk_entry *entries = (struct bulk_entry *)tr->malloc(tr->count * sizeof(struct bulk_entry));
+    if (!entries) { return false; }
+    size_t n = node_collect(tr->root, entries, 0);
+    struct node *root = tr->root;
+    struct node_pool *pool = tr->pool;
+    bool fresh = !tr->concurrent && !pool_shared(tr);
+    if (fresh && !(tr->pool = pool_new(tr))) {
+        tr->pool = pool;
+        tr->free(entries);
+        return false;
+    }
+    if (!bulk_build(tr, entries, n)) {
+        if (fresh) {
+            pool_free(tr, tr->pool);
+            tr->pool = pool;
+        }
+        return false;
+    }
+    if (fresh) {
+        pool_free(tr, pool);
+        tr->pending = NULL; // lived in the old pool
+    } else {
+        node_retire(tr, root);
+    }
+    return true;
+}
+
+// rebuilds a tree that deletions and updates have left fragmented, searches may run meanwhile in concurrent mode
+bool rtree_compact(struct rtree *tr) {
+    if (tr->map) { return false; }
+    writer_lock(tr);
+    bool ok = tree_compact(tr);
+    writer_unlock(tr);
+    return ok;
+}
+
+// returns a point-in-time copy that shares every node with the tree, each of the two copies the shared nodes
+// on its path before modifying them. the trees share the node pool and may be used from different threads,
+// a concurrent tree keeps serving searches and takes its writer lock only for the copy itself
+struct rtree *rtree_clone(struct rtree *tr) {
+    if (tr->map) { return NULL; }
+    struct rtree *clone = (struct rtree *)tr->malloc(sizeof(struct rtree));
+    if (!clone) { return NULL; }
+    memset(clone, 0, sizeof(struct rtree));
+    clone->malloc = tr->malloc;
+    clone->free = tr->free;
+    clone->pool = tr->pool;
+    pthread_mutex_init(&clone->lock, NULL);
+    writer_lock(tr);
+    clone->count = tr->count;
+    clone->height = tr->height;
+    clone->rect = tr->rect;
+    clone->root = tr->root;
+    clone->split = tr->split;
+    clone->chooser = tr->chooser;
+    clone->reinsert = tr->reinsert;
+    clone->hilbert = tr->hilbert;
+    clone->frame = tr->frame;
+    clone->gen = tr->gen + 1; // inherited nodes belong to an older generation
+    if (clone->root) {
+        __atomic_add_fetch(&clone->root->rc, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&tr->pool->refs, 1, __ATOMIC_ACQ_REL);
+    writer_unlock(tr);
+    return clone;
+}
+
+// all nodes, including retired ones, live in the pool, so the tree is released slab by slab without a walk.
+// while clones share the pool only the nodes no other tree refers to are handed back to it
+void rtree_free(struct rtree *tr) {
+    if (tr->map) { munmap((void *)tr->map, tr->map_size); }
+    if (pool_shared(tr)) {
+        if (tr->root) { node_free(tr, tr->root); }
+        if (tr->pending) { node_free(tr, tr->pending); }
+        limbo_free(tr, &tr->limbo[0]);
+        limbo_free(tr, &tr->limbo[1]);
+    }
+    if (__atomic_sub_fetch(&tr->pool->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        pool_free(tr, tr->pool);
+    }
+    for (int i = 0; i < 2; i++) {
+        if (tr->limbo[i].nodes) { tr->free(tr->limbo[i].nodes); }
+    }
+    workers_free(tr->workers, tr->free);
+    pthread_mutex_destroy(&tr->lock);
+    tr->free(tr);
+}
+
+// reports every item of the subtree, the caller found the whole subtree to match
+static bool node_emit(struct rtree *tr, struct node *node, bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data, void *udata), void *udata) {
+    STAT(tr, nodes_visited, 1);
+    if (node->kind == LEAF) {
+        STAT(tr, leaf_hits, node->count);
+        for (int i = 0; i < node->count; i++) {
+            if (!iter(node->rects[i].min, node->rects[i].max, node->items[i].data, udata)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    for (int i = 0; i < node->count; i++) {
+        node_prefetch(node->children[i]);
+    }
+    for (int i = 0; i < node->count; i++) {
+        if (!node_emit(tr, node->children[i], iter, udata)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// reports the items matching pred. branches that cannot hold a match are skipped, and children lying inside
+// the window are emitted whole when every item inside the window matches
+static bool node_search(struct rtree *tr, struct node *node, struct rect *rect, enum rtree_predicate pred, bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data, void *udata), void *udata) {
+    struct rtree_mask mask = node_intersects_mask(node, rect);
+    STAT(tr, nodes_visited, 1);
+    STAT(tr, rect_tests, node->count);
+    if (node->kind == LEAF) {
+        while (mask_any(&mask)) {
+            int i = mask_take(&mask);
+            if ((pred == RTREE_WITHIN && !rect_contains(rect, &node->rects[i])) ||
+                (pred == RTREE_CONTAINS && !rect_contains(&node->rects[i], rect))) {
+                continue;
+            }
+            STAT(tr, leaf_hits, 1);
+            if (!iter(node->rects[i].min, node->rects[i].max, node->items[i].data, udata)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    struct rtree_mask inside = { { 0 } };
+    for (struct rtree_mask m = mask; mask_any(&m); ) { // every child is requested before the first is visited, their misses overlap
+        int i = mask_take(&m);
+        if (pred == RTREE_CONTAINS) { // an item covering the window needs a child covering it
+            if (!rect_contains(&node->rects[i], rect)) {
+                mask_unset(&mask, i);
+                continue;
+            }
+        } else if (rect_contains(rect, &node->rects[i])) {
+            mask_set(&inside, i);
+        }
+        node_prefetch(node->children[i]);
+    }
+    while (mask_any(&mask)) {
+        int i = mask_take(&mask);
+        bool ok = mask_has(&inside, i) ? node_emit(tr, node->children[i], iter, udata) :
+                                    node_search(tr, node->children[i], rect, pred, iter, udata);
+        if (!ok) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// on-disk layout written by rtree_save, in native byte order. nodes refer to each other by file offset,
+// children are stored before their parent and the root comes last
+#define FLAT_MAGIC "RTREEMAP"
+#define FLAT_VERSION 1
+
+struct flat_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t dims;
+    uint32_t numsize;       // sizeof(NUMTYPE)
+    uint32_t max_entries;
+    uint64_t count;
+    uint64_t height;
+    uint64_t root;          // offset of the root node, 0 for an empty tree
+    struct rect rect;
+};
+
+// followed by count rects, then count refs (child offsets or item data) on the next 8 byte boundary
+struct flat_node {
+    uint32_t kind;
+    uint32_t count;
+};
+
+// quantized layout written by rtree_save_packed, with the same header and node order. a branch stores the
+// boxes of its entries as cells of a grid over the branch, rounded outwards so that searches never miss.
+// a leaf keeps exact coordinates but stores its points without the max corner
+#define PACK_MAGIC "RTREEPAK"
+#define PACK_CELLS 65535    // grid lines per dimension of a branch after the first, boxes are stored as uint16_t
+
+// grid of a packed branch, followed by count boxes of 2 * DIMS cells (min corner first)
+struct pack_grid {
+    double base[DIMS];
+    double step[DIMS];
+};
+
+// packed leaf, followed by its points entries as DIMS coordinates each, then the rects of the others
+struct pack_leaf {
+    uint64_t points;
+};
+
+static size_t flat_refs_offset(int kind, int count, int points, bool packed) {
+    size_t body = count * sizeof(struct rect);
+    if (packed && kind == BRANCH) {
+        body = sizeof(struct pack_grid) + count * 2 * DIMS * sizeof(uint16_t);
+    } else if (packed) {
+        body = sizeof(struct pack_leaf) + points * DIMS * sizeof(NUMTYPE) + (count - points) * sizeof(struct rect);
+    }
+    return (sizeof(struct flat_node) + body + 7) & ~(size_t)7;
+}
+
+static size_t flat_node_size(int kind, int count, int points, bool packed) {
+    return flat_refs_offset(kind, count, points, packed) + count * sizeof(uint64_t);
+}
+
+static int flat_points(const struct flat_node *node, bool packed) {
+    return packed && node->kind == LEAF ? (int)((const struct pack_leaf *)(node + 1))->points : 0;
+}
+
+static const struct rect *flat_rects(const struct flat_node *node) {
+    return (const struct rect *)(node + 1);
+}
+
+static const uint64_t *flat_refs(const struct flat_node *node, bool packed) {
+    return (const uint64_t *)((const char *)node + flat_refs_offset(node->kind, node->count, flat_points(node, packed), packed));
+}
+
+static const struct flat_node *flat_root(const void *map) {
+    const struct flat_header *header = (const struct flat_header *)map;
+    return (const struct flat_node *)((const char *)map + header->root);
+}
+
+static const struct flat_node *flat_child(const struct rtree *tr, const struct flat_node *node, int index) {
+    return (const struct flat_node *)((const char *)tr->map + flat_refs(node, tr->packed)[index]);
+}
+
+static double pack_line(const struct pack_grid *grid, int d, int q) {
+    return grid->base[d] + q * grid->step[d];
+}
+
+// last grid line at or below x, -1 when there is none
+static int pack_floor(const struct pack_grid *grid, int d, double x) {
+    if (!(grid->step[d] > 0)) {
+        return x >= grid->base[d] ? PACK_CELLS : -1;
+    }
+    double t = (x - grid->base[d]) / grid->step[d];
+    int q = t < 0 ? -1 : t > PACK_CELLS ? PACK_CELLS : (int)t;
+    while (q < PACK_CELLS && pack_line(grid, d, q + 1) <= x) { q++; }
+    while (q >= 0 && pack_line(grid, d, q) > x) { q--; }
+    return q;
+}
+
+// first grid line at or above x, PACK_CELLS + 1 when there is none
+static int pack_ceil(const struct pack_grid *grid, int d, double x) {
+    if (!(grid->step[d] > 0)) {
+        return x <= grid->base[d] ? 0 : PACK_CELLS + 1;
+    }
+    double t = (x - grid->base[d]) / grid->step[d];
+    int q = t < 0 ? 0 : t > PACK_CELLS ? PACK_CELLS + 1 : (int)t;
+    while (q > 0 && pack_line(grid, d, q - 1) >= x) { q--; }
+    while (q <= PACK_CELLS && pack_line(grid, d, q) < x) { q++; }
+    return q;
+}
+
+static struct pack_grid pack_grid_new(const struct rect *rect) {
+    struct pack_grid grid;
+    for (int d = 0; d < DIMS; d++) {
+        grid.base[d] = rect->min[d];
+        grid.step[d] = ((double)rect->max[d] - (double)rect->min[d]) / PACK_CELLS;
+        while (pack_line(&grid, d, PACK_CELLS) < rect->max[d]) { // rounding may leave the last line short of the max
+            grid.step[d] = grid.step[d] > 0 ? grid.step[d] * (1 + DBL_EPSILON) : DBL_MIN;
+        }
+    }
+    return grid;
+}
+
+// rects_intersects_mask for a packed branch, the window is snapped outwards to the grid once and the
+// boxes are compared as integers
+static struct rtree_mask pack_branch_mask(const struct flat_node *node, const struct rect *rect) {
+    const struct pack_grid *grid = (const struct pack_grid *)(node + 1);
+    const uint16_t *boxes = (const uint16_t *)(grid + 1);
+    int lo[DIMS], hi[DIMS];
+    for (int d = 0; d < DIMS; d++) {
+        lo[d] = pack_ceil(grid, d, rect->min[d]);
+        hi[d] = pack_floor(grid, d, rect->max[d]);
+    }
+    struct rtree_mask mask = { { 0 } };
+    for (int i = 0; i < (int)node->count; i++) {
+        const uint16_t *box = &boxes[i * 2 * DIMS];
+        bool hit = true;
+        for (int d = 0; d < DIMS; d++) {
+            hit &= (box[d] <= hi[d]) & (box[DIMS + d] >= lo[d]);
+        }
+        mask.words[i / 64] |= (uint64_t)hit << (i % 64);
+    }
+    return mask;
+}
+
+static const NUMTYPE *pack_points(const struct flat_node *node) {
+    return (const NUMTYPE *)((const struct pack_leaf *)(node + 1) + 1);
+}
+
+static const struct rect *pack_rects(const struct flat_node *node, int points) {
+    return (const struct rect *)(pack_points(node) + points * DIMS);
+}
+
+static struct rtree_mask pack_leaf_mask(const struct flat_node *node, const struct rect *rect) {
+    int n = flat_points(node, true);
+    struct rtree_mask mask = points_mask(pack_points(node), n, rect);
+    if (n < (int)node->count) {
+        struct rtree_mask rects = rects_mask(pack_rects(node, n), node->count - n, rect);
+        mask_or_shifted(&mask, &rects, n);
+    }
+    return mask;
+}
+
+static struct rtree_mask flat_mask(const struct rtree *tr, const struct flat_node *node, const struct rect *rect) {
+    if (!tr->packed) {
+        return rects_mask(flat_rects(node), node->count, rect);
+    }
+    return node->kind == BRANCH ? pack_branch_mask(node, rect) : pack_leaf_mask(node, rect);
+}
+
+// entries of a mapped leaf: its points, stored without the max corner, then its rects
+struct flat_leaf {
+    int points;
+    const NUMTYPE *coords;
+    const struct rect *rects;
+};
+
+static struct flat_leaf flat_leaf(const struct rtree *tr, const struct flat_node *node) {
+    struct flat_leaf leaf = { .points = flat_points(node, tr->packed), .rects = flat_rects(node) };
+    if (tr->packed) {
+        leaf.coords = pack_points(node);
+        leaf.rects = pack_rects(node, leaf.points);
+    }
+    return leaf;
+}
+
+// corners of a leaf entry, a point is its own max corner
+static void flat_entry(const struct flat_leaf *leaf, int index, const NUMTYPE **min, const NUMTYPE **max) {
+    if (index < leaf->points) {
+        *min = *max = &leaf->coords[index * DIMS];
+    } else {
+        *min = leaf->rects[index - leaf->points].min;
+        *max = leaf->rects[index - leaf->points].max;
+    }
+}
+
+// rect of the branch entry at index, packed boxes are decoded into box. they are widened to the grid lines,
+// so a decoded box contains the subtree it bounds
+static const struct rect *flat_box(const struct rtree *tr, const struct flat_node *node, int index, struct rect *box) {
+    if (!tr->packed) {
+        return &flat_rects(node)[index];
+    }
+    const struct pack_grid *grid = (const struct pack_grid *)(node + 1);
+    const uint16_t *cells = (const uint16_t *)(grid + 1) + index * 2 * DIMS;
+    for (int d = 0; d < DIMS; d++) {
+        box->min[d] = pack_line(grid, d, cells[d]);
+        box->max[d] = pack_line(grid, d, cells[DIMS + d]);
+    }
+    return box;
+}
+
+static bool flat_emit(const struct rtree *tr, const struct flat_node *node, bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data, void *udata), void *udata) {
+    const uint64_t *refs = flat_refs(node, tr->packed);
+    STAT(tr, nodes_visited, 1);
+    if (node->kind == BRANCH) {
+        for (int i = 0; i < (int)node->count; i++) {
+            node_prefetch((const char *)tr->map + refs[i]);
+        }
+        for (int i = 0; i < (int)node->count; i++) {
+            if (!flat_emit(tr, flat_child(tr, node, i), iter, udata)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    struct flat_leaf leaf = flat_leaf(tr, node);
+    STAT(tr, leaf_hits, node->count);
+    for (int i = 0; i < (int)node->count; i++) {
+        const NUMTYPE *min, *max;
+        DATATYPE data;
+        flat_entry(&leaf, i, &min, &max);
+        memcpy(&data, &refs[i], sizeof(DATATYPE));
+        if (!iter(min, max, data, udata)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// node_search over the mapped pages
+static bool flat_search(const struct rtree *tr, const struct flat_node *node, struct rect *rect, enum rtree_predicate pred, bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data, void *udata), void *udata) {
+    const uint64_t *refs = flat_refs(node, tr->packed);
+    struct rtree_mask mask = flat_mask(tr, node, rect);
+    STAT(tr, nodes_visited, 1);
+    STAT(tr, rect_tests, node->count);
+    if (node->kind == BRANCH) {
+        struct rtree_mask inside = { { 0 } };
+        for (struct rtree_mask m = mask; mask_any(&m); ) {
+            int i = mask_take(&m);
+            struct rect decoded;
+            const struct rect *box = flat_box(tr, node, i, &decoded);
+            if (pred == RTREE_CONTAINS) {
+                if (!rect_contains(box, rect)) {
+                    mask_unset(&mask, i);
+                    continue;
+                }
+            } else if (rect_contains(rect, box)) {
+                mask_set(&inside, i);
+            }
+            node_prefetch((const char *)tr->map + refs[i]);
+        }
+        while (mask_any(&mask)) {
+            int i = mask_take(&mask);
+            bool ok = mask_has(&inside, i) ? flat_emit(tr, flat_child(tr, node, i), iter, udata) :
+                                        flat_search(tr, flat_child(tr, node, i), rect, pred, iter, udata);
+            if (!ok) {
+                return false;
+            }
+        }
+        return true;
+    }
+    struct flat_leaf leaf = flat_leaf(tr, node);
+    while (mask_any(&mask)) {
+        int i = mask_take(&mask);
+        struct rect entry;
+        const NUMTYPE *min, *max;
+        DATATYPE data;
+        flat_entry(&leaf, i, &min, &max);
+        if (pred != RTREE_INTERSECTS) {
+            memcpy(entry.min, min, sizeof(NUMTYPE) * DIMS);
+            memcpy(entry.max, max, sizeof(NUMTYPE) * DIMS);
+            if (pred == RTREE_WITHIN ? !rect_contains(rect, &entry) : !rect_contains(&entry, rect)) {
+                continue;
+            }
+        }
+        memcpy(&data, &refs[i], sizeof(DATATYPE));
+        STAT(tr, leaf_hits, 1);
+        if (!iter(min, max, data, udata)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// returns false when iter stopped the search
+static bool tree_search(struct rtree *tr, struct rect *rect, enum rtree_predicate pred, bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data, void *udata), void *udata) {
+    if (tr->map) {
+        return !(tr->count > 0 && rect_intersects(&tr->rect, rect)) || flat_search(tr, flat_root(tr->map), rect, pred, iter, udata);
+    }
+    int slot;
+    bool ok = true;
+    struct node *root = reader_lock(tr, &slot);
+    if (root && (tr->concurrent || rect_intersects(&tr->rect, rect))) {
+        ok = node_search(tr, root, rect, pred, iter, udata);
+    }
+    reader_unlock(tr, slot);
+    return ok;
+}
+
+// rtree_search with a choice of predicate, see enum rtree_predicate. a point window with RTREE_CONTAINS
+// finds the rects containing the point
+void rtree_search_ex(struct rtree *tr, const NUMTYPE *min, const NUMTYPE *max, enum rtree_predicate pred, bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data, void *udata), void *udata) {
+    struct rect rect;
+    memcpy(&rect.min[0], min, sizeof(NUMTYPE) * DIMS);
+    memcpy(&rect.max[0], max ? max : min, sizeof(NUMTYPE) * DIMS);
+    tree_search(tr, &rect, pred, iter, udata);
+}
+
+void rtree_search(struct rtree *tr, const NUMTYPE *min, const NUMTYPE *max, bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data, void *udata), void *udata) {
+    rtree_search_ex(tr, min, max, RTREE_INTERSECTS, iter, udata);
+}
+
+#define BATCH_GROUP 64 // queries sharing one traversal, one bit each in the active masks
+
+struct batch {
+    const struct rtree *tr;
+    struct node *root;
+    const struct flat_node *flat; // root of a mapped tree, root is NULL then
+    struct rtree_query *queries;
+    struct bulk_entry *order;   // queries in spatial order, index refers to queries
+    size_t n;
+    size_t next;                // first query of the next group to be taken by a worker
+    bool (*iter)(size_t query, const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data, void *udata);
+    void *udata;
+};
+
+struct batch_group {
+    struct batch *b;
+    struct rect rects[BATCH_GROUP];
+    size_t ids[BATCH_GROUP];
+    uint64_t stopped;           // queries whose callback asked to stop
+};
+
+static bool batch_emit(struct batch_group *g, int q, const NUMTYPE *min, const NUMTYPE *max, DATATYPE data) {
+    struct rtree_query *query = &g->b->queries[g->ids[q]];
+    if (query->count < query->cap) {
+        query->results[query->count] = data;
+    }
+    query->count++;
+    return !g->b->iter || g->b->iter(g->ids[q], min, max, data, g->b->udata);
+}
+
+// visits the node once for all active queries of the group and descends into each child with the queries that hit it
+static void node_search_batch(struct batch_group *g, struct node *node, uint64_t active) {
+    struct rtree_mask masks[BATCH_GROUP], any = { { 0 } };
+    for (uint64_t a = active; a; a &= a - 1) {
+        int q = word_first(a);
+        masks[q] = node_intersects_mask(node, &g->rects[q]);
+        mask_or(&any, &masks[q]);
+    }
+    if (node->kind == LEAF) {
+        for (uint64_t a = active; a; a &= a - 1) {
+            int q = word_first(a);
+            for (struct rtree_mask m = masks[q]; mask_any(&m) && !(g->stopped >> q & 1); ) {
+                int i = mask_take(&m);
+                if (!batch_emit(g, q, node->rects[i].min, node->rects[i].max, node->items[i].data)) {
+                    g->stopped |= (uint64_t)1 << q;
+                }
+            }
+        }
+        return;
+    }
+    for (struct rtree_mask m = any; mask_any(&m); ) {
+        int i = mask_take(&m);
+        node_prefetch(node->children[i]);
+    }
+    while (mask_any(&any)) {
+        int i = mask_take(&any);
+        uint64_t sub = 0;
+        for (uint64_t a = active & ~g->stopped; a; a &= a - 1) {
+            int q = word_first(a);
+            sub |= (uint64_t)mask_has(&masks[q], i) << q;
+        }
+        if (sub) {
+            node_search_batch(g, node->children[i], sub);
+        }
+    }
+}
+
+// node_search_batch over the mapped pages
+static void flat_search_batch(struct batch_group *g, const struct flat_node *node, uint64_t active) {
+    const struct rtree *tr = g->b->tr;
+    const uint64_t *refs = flat_refs(node, tr->packed);
+    struct rtree_mask masks[BATCH_GROUP], any = { { 0 } };
+    for (uint64_t a = active; a; a &= a - 1) {
+        int q = word_first(a);
+        masks[q] = flat_mask(tr, node, &g->rects[q]);
+        mask_or(&any, &masks[q]);
+    }
+    if (node->kind == LEAF) {
+        struct flat_leaf leaf = flat_leaf(tr, node);
+        for (uint64_t a = active; a; a &= a - 1) {
+            int q = word_first(a);
+            for (struct rtree_mask m = masks[q]; mask_any(&m) && !(g->stopped >> q & 1); ) {
+                int i = mask_take(&m);
+                const NUMTYPE *min, *max;
+                DATATYPE data;
+                flat_entry(&leaf, i, &min, &max);
+                memcpy(&data, &refs[i], sizeof(DATATYPE));
+                if (!batch_emit(g, q, min, max, data)) {
+                    g->stopped |= (uint64_t)1 << q;
+                }
+            }
+        }
+        return;
+    }
+    for (struct rtree_mask m = any; mask_any(&m); ) {
+        int i = mask_take(&m);
+        node_prefetch((const char *)tr->map + refs[i]);
+    }
+    while (mask_any(&any)) {
+        int i = mask_take(&any);
+        uint64_t sub = 0;
+        for (uint64_t a = active & ~g->stopped; a; a &= a - 1) {
+            int q = word_first(a);
+            sub |= (uint64_t)mask_has(&masks[q], i) << q;
+        }
+        if (sub) {
+            flat_search_batch(g, flat_child(tr, node, i), sub);
+        }
+    }
+}
+
+// takes groups of spatially close queries until none are left, workers only share the group counter
+static void *batch_worker(void *arg) {
+    struct batch *b = (struct batch *)arg;
+    struct batch_group g;
+    g.b = b;
+    for (;;) {
+        size_t first = __atomic_fetch_add(&b->next, BATCH_GROUP, __ATOMIC_RELAXED);
+        if (first >= b->n) {
+            return NULL;
+        }
+        int count = (int)MIN(BATCH_GROUP, b->n - first);
+        for (int q = 0; q < count; q++) {
+            g.rects[q] = b->order[first + q].rect;
+            g.ids[q] = b->order[first + q].index;
+        }
+        g.stopped = 0;
+        uint64_t active = count == 64 ? ~(uint64_t)0 : ((uint64_t)1 << count) - 1;
+        if (b->flat) {
+            flat_search_batch(&g, b->flat, active);
+        } else {
+            node_search_batch(&g, b->root, active);
+        }
+    }
+}
+
+// runs n window queries on up to nthreads threads, the tree keeps the threads for its later calls. hits are
+// stored in each query's results buffer and passed to iter (optional, called from the worker threads) with the
+// index of the query, returning false stops that query only. returns false when out of memory
+bool rtree_search_batch(struct rtree *tr, struct rtree_query *queries, size_t n, bool (*iter)(size_t query, const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data, void *udata), void *udata, int nthreads) {
+    for (size_t i = 0; i < n; i++) {
+        queries[i].count = 0;
+    }
+    int slot;
+    struct node *root = reader_lock(tr, &slot);
+    const struct flat_node *flat = tr->map && tr->count > 0 ? flat_root(tr->map) : NULL;
+    if ((!root && !flat) || n == 0) {
+        reader_unlock(tr, slot);
+        return true;
+    }
+    struct bulk_entry *order = (struct bulk_entry *)tr->malloc(n * sizeof(struct bulk_entry));
+    if (!order) {
+        reader_unlock(tr, slot);
+        return false;
+    }
+    for (size_t i = 0; i < n; i++) {
+        memcpy(&order[i].rect.min[0], queries[i].min, sizeof(NUMTYPE) * DIMS);
+        memcpy(&order[i].rect.max[0], queries[i].max, sizeof(NUMTYPE) * DIMS);
+        order[i].index = i;
+    }
+    bulk_str_sort(order, n, 0, BATCH_GROUP);
+    struct batch b = { .tr = tr, .root = root, .flat = flat, .queries = queries, .order = order, .n = n, .iter = iter, .udata = udata };
+    size_t groups = (n + BATCH_GROUP - 1) / BATCH_GROUP;
+    workers_run(&tr->workers, tr->malloc, tr->free, (int)MIN((size_t)MAX(nthreads, 1), groups), batch_worker, &b);
+    tr->free(order);
+    reader_unlock(tr, slot);
+    return true;
+}
+
+// a pair of nodes, one from each tree, whose rects intersect
+struct join_pair {
+    struct node *a;
+    struct node *b;
+    struct rect ar;
+    struct rect br;
+};
+
+struct join {
+    struct rtree *a;
+    struct rtree *b;
+    bool (*iter)(const NUMTYPE *amin, const NUMTYPE *amax, const DATATYPE adata, const NUMTYPE *bmin, const NUMTYPE *bmax, const DATATYPE bdata, void *udata);
+    void *udata;
+    struct join_pair *pairs;    // top level pairs handed to the workers, NULL when joining on one thread
+    bool splitting;             // pairs below the roots are queued instead of descended into
+    size_t n;
+    size_t next;                // first pair not yet taken by a worker
+    bool stopped;               // the callback asked to stop
+};
+
+static bool node_join(struct join *j, struct node *a, struct rect *ar, struct node *b, struct rect *br);
+
+// descends into a pair, or queues it while the top level is split between the workers
+static bool join_descend(struct join *j, struct node *a, struct rect *ar, struct node *b, struct rect *br) {
+    if (j->splitting) {
+        j->pairs[j->n++] = (struct join_pair){ .a = a, .b = b, .ar = *ar, .br = *br };
+        return true;
+    }
+    return node_join(j, a, ar, b, br);
+}
+
+// synchronized traversal of two subtrees. only entries inside the other node's rect take part, and a
+// branch facing a leaf descends alone so that trees of different heights meet at their leaves
+static bool node_join(struct join *j, struct node *a, struct rect *ar, struct node *b, struct rect *br) {
+    if (__atomic_load_n(&j->stopped, __ATOMIC_RELAXED)) {
+        return false;
+    }
+    STAT(j->a, nodes_visited, 1);
+    STAT(j->b, nodes_visited, 1);
+    if (a->kind != b->kind) {
+        struct node *branch = a->kind == BRANCH ? a : b;
+        struct rtree_mask mask = node_intersects_mask(branch, a->kind == BRANCH ? br : ar);
+        STAT(branch == a ? j->a : j->b, rect_tests, branch->count);
+        for (struct rtree_mask m = mask; mask_any(&m); ) {
+            int i = mask_take(&m);
+            node_prefetch(branch->children[i]);
+        }
+        while (mask_any(&mask)) {
+            int i = mask_take(&mask);
+            bool ok = branch == a ? join_descend(j, a->children[i], &a->rects[i], b, br) :
+                                    join_descend(j, a, ar, b->children[i], &b->rects[i]);
+            if (!ok) {
+                return false;
+            }
+        }
+        return true;
+    }
+    struct rtree_mask amask = node_intersects_mask(a, br);
+    struct rtree_mask bmask = node_intersects_mask(b, ar);
+    struct rtree_mask masks[MAX_ENTRIES], any = { { 0 } };
+    STAT(j->a, rect_tests, a->count);
+    STAT(j->b, rect_tests, b->count);
+    if (!mask_any(&bmask)) {
+        return true;
+    }
+    for (struct rtree_mask m = amask; mask_any(&m); ) {
+        int i = mask_take(&m);
+        struct rtree_mask hits = node_intersects_mask(b, &a->rects[i]);
+        masks[i] = mask_and(&hits, &bmask);
+        mask_or(&any, &masks[i]);
+        STAT(j->b, rect_tests, b->count);
+    }
+    if (!mask_any(&any)) {
+        return true;
+    }
+    if (a->kind == LEAF) {
+        while (mask_any(&amask)) {
+            int i = mask_take(&amask);
+            for (struct rtree_mask m = masks[i]; mask_any(&m); ) {
+                int k = mask_take(&m);
+                STAT(j->a, leaf_hits, 1);
+                STAT(j->b, leaf_hits, 1);
+                if (!j->iter(a->rects[i].min, a->rects[i].max, a->items[i].data, b->rects[k].min, b->rects[k].max, b->items[k].data, j->udata)) {
+                    __atomic_store_n(&j->stopped, true, __ATOMIC_RELAXED);
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+    for (struct rtree_mask m = amask; mask_any(&m); ) {
+        int i = mask_take(&m);
+        if (mask_any(&masks[i])) {
+            node_prefetch(a->children[i]);
+        }
+    }
+    for (struct rtree_mask m = any; mask_any(&m); ) {
+        int i = mask_take(&m);
+        node_prefetch(b->children[i]);
+    }
+    while (mask_any(&amask)) {
+        int i = mask_take(&amask);
+        for (struct rtree_mask m = masks[i]; mask_any(&m); ) {
+            int k = mask_take(&m);
+            if (!join_descend(j, a->children[i], &a->rects[i], b->children[k], &b->rects[k])) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// takes top level pairs until none are left or the join was stopped
+static void *join_worker(void *arg) {
+    struct join *j = (struct join *)arg;
+    for (;;) {
+        size_t i = __atomic_fetch_add(&j->next, 1, __ATOMIC_RELAXED);
+        if (i >= j->n) {
+            return NULL;
+        }
+        struct join_pair *p = &j->pairs[i];
+        if (!node_join(j, p->a, &p->ar, p->b, &p->br)) {
+            return NULL;
+        }
+    }
+}
+
+// calls iter for every pair of items, one from each tree, whose rects intersect. the trees are
+// walked together so that pairs of subtrees that cannot meet are never visited. with nthreads above
+// one the pairs below the roots are shared between that many threads, taken from the threads a keeps,
+// and iter is called from all of them. returning false from iter stops the join. returns false when out of memory or when
+// either tree is mapped
+bool rtree_join_parallel(struct rtree *a, struct rtree *b, bool (*iter)(const NUMTYPE *amin, const NUMTYPE *amax, const DATATYPE adata, const NUMTYPE *bmin, const NUMTYPE *bmax, const DATATYPE bdata, void *udata), void *udata, int nthreads) {
+    if (a->map || b->map) { return false; }
+    int aslot, bslot;
+    struct node *aroot = reader_lock(a, &aslot);
+    struct node *broot = reader_lock(b, &bslot);
+    bool ok = true;
+    if (aroot && broot && aroot->count > 0 && broot->count > 0) {
+        struct rect ar = node_rect_calc(aroot), br = node_rect_calc(broot);
+        struct join j = { .a = a, .b = b, .iter = iter, .udata = udata };
+        if (nthreads > 1 && (aroot->kind == BRANCH || broot->kind == BRANCH)) {
+            j.pairs = (struct join_pair *)a->malloc(aroot->count * broot->count * sizeof(struct join_pair));
+            ok = j.splitting = j.pairs != NULL;
+        }
+        if (ok && rect_intersects(&ar, &br)) {
+            node_join(&j, aroot, &ar, broot, &br);
+        }
+        if (j.pairs) {
+            j.splitting = false;
+            workers_run(&a->workers, a->malloc, a->free, (int)MIN((size_t)nthreads, j.n), join_worker, &j);
+            a->free(j.pairs);
+        }
+    }
+    reader_unlock(b, bslot);
+    reader_unlock(a, aslot);
+    return ok;
+}
+
+bool rtree_join(struct rtree *a, struct rtree *b, bool (*iter)(const NUMTYPE *amin, const NUMTYPE *amax, const DATATYPE adata, const NUMTYPE *bmin, const NUMTYPE *bmax, const DATATYPE bdata, void *udata), void *udata) {
+    return rtree_join_parallel(a, b, iter, udata, 1);
+}
+
+static void cursor_push(struct rtree_cursor *cur, const void *node) {
+    struct rtree_cursor_frame *frame = &cur->stack[++cur->depth];
+    frame->node = node;
+    if (cur->tr->map) {
+        const struct flat_node *fn = (const struct flat_node *)node;
+        frame->mask = flat_mask(cur->tr, fn, &cur->rect);
+        for (struct rtree_mask m = frame->mask; fn->kind == BRANCH && mask_any(&m); ) {
+            int i = mask_take(&m);
+            node_prefetch(flat_child(cur->tr, fn, i));
+        }
+    } else {
+        struct node *n = (struct node *)node;
+        frame->mask = node_intersects_mask(n, &cur->rect);
+        for (struct rtree_mask m = frame->mask; n->kind == BRANCH && mask_any(&m); ) {
+            int i = mask_take(&m);
+            node_prefetch(n->children[i]);
+        }
+    }
+}
+
+// starts a window query that is pulled with rtree_cursor_next, the cursor keeps its own stack
+// and needs no allocation. in concurrent mode the cursor reads the snapshot pinned here until close.
+// returns false, with nothing to close, when the tree is deeper than RTREE_CURSOR_DEPTH levels
+bool rtree_cursor_open(struct rtree_cursor *cur, struct rtree *tr, const NUMTYPE *min, const NUMTYPE *max) {
+    cur->tr = tr;
+    cur->depth = -1;
+    cur->slot = -1;
+    memcpy(&cur->rect.min[0], min, sizeof(NUMTYPE) * DIMS);
+    memcpy(&cur->rect.max[0], max ? max : min, sizeof(NUMTYPE) * DIMS);
+    if (tr->map) {
+        if (tr->height >= RTREE_CURSOR_DEPTH) { return false; }
+        if (tr->count > 0 && rect_intersects(&tr->rect, &cur->rect)) {
+            cursor_push(cur, flat_root(tr->map));
+        }
+        return true;
+    }
+    struct node *root = reader_lock(tr, &cur->slot);
+    int height = 0; // of the pinned root, tr->height may already belong to a newer one
+    for (struct node *node = root; node && node->kind == BRANCH; node = node->children[0]) {
+        height++;
+    }
+    if (height >= RTREE_CURSOR_DEPTH) {
+        reader_unlock(tr, cur->slot);
+        cur->slot = -1;
+        return false;
+    }
+    if (root && (tr->concurrent || rect_intersects(&tr->rect, &cur->rect))) {
+        cursor_push(cur, root);
+    }
+    return true;
+}
+
+// moves to the next item intersecting the window, returns false once the query is exhausted
+bool rtree_cursor_next(struct rtree_cursor *cur, const NUMTYPE **min, const NUMTYPE **max, DATATYPE *data) {
+    while (cur->depth >= 0) {
+        struct rtree_cursor_frame *frame = &cur->stack[cur->depth];
+        if (!mask_any(&frame->mask)) {
+            cur->depth--;
+            continue;
+        }
+        int i = mask_take(&frame->mask);
+        if (cur->tr->map) {
+            const struct flat_node *fn = (const struct flat_node *)frame->node;
+            if (fn->kind == BRANCH) {
+                cursor_push(cur, flat_child(cur->tr, fn, i));
+                continue;
+            }
+            struct flat_leaf leaf = flat_leaf(cur->tr, fn);
+            flat_entry(&leaf, i, min, max);
+            memcpy(data, &flat_refs(fn, cur->tr->packed)[i], sizeof(DATATYPE));
+            return true;
+        }
+        struct node *node = (struct node *)frame->node;
+        if (node->kind == BRANCH) {
+            cursor_push(cur, node->children[i]);
+            continue;
+        }
+        *min = node->rects[i].min;
+        *max = node->rects[i].max;
+        *data = node->items[i].data;
+        return true;
+    }
+    return false;
+}
+
+void rtree_cursor_close(struct rtree_cursor *cur) {
+    reader_unlock(cur->tr, cur->slot);
+    cur->slot = -1;
+    cur->depth = -1;
+}
+
+// in concurrent mode tr->count belongs to the writer, readers take the total of the root they pin
+size_t rtree_count(struct rtree *tr) {
+    if (!tr->concurrent) {
+        return tr->count;
+    }
+    int slot;
+    struct node *root = reader_lock(tr, &slot);
+    size_t count = root ? node_total(root) : 0;
+    reader_unlock(tr, slot);
+    return count;
+}
+
+// adds up the items intersecting rect, children the rect contains are taken whole from their totals
+static size_t node_count_in(struct rtree *tr, struct node *node, struct rect *rect) {
+    struct rtree_mask mask = node_intersects_mask(node, rect);
+    STAT(tr, nodes_visited, 1);
+    STAT(tr, rect_tests, node->count);
+    if (node->kind == LEAF) {
+        return mask_size(&mask);
+    }
+    struct rtree_mask inside = { { 0 } };
+    for (struct rtree_mask m = mask; mask_any(&m); ) {
+        int i = mask_take(&m);
+        if (rect_contains(rect, &node->rects[i])) {
+            mask_set(&inside, i);
+            prefetch(node->children[i]); // only the total is read
+        } else {
+            node_prefetch(node->children[i]);
+        }
+    }
+    size_t n = 0;
+    for (struct rtree_mask m = inside; mask_any(&m); ) {
+        n += node_total(node->children[mask_take(&m)]);
+    }
+    for (struct rtree_mask m = mask_andnot(&mask, &inside); mask_any(&m); ) {
+        n += node_count_in(tr, node->children[mask_take(&m)], rect);
+    }
+    return n;
+}
+
+// mapped trees keep no totals, every intersecting leaf is visited
+static size_t flat_count_in(const struct rtree *tr, const struct flat_node *node, struct rect *rect) {
+    struct rtree_mask mask = flat_mask(tr, node, rect);
+    STAT(tr, nodes_visited, 1);
+    STAT(tr, rect_tests, node->count);
+    if (node->kind == LEAF) {
+        return mask_size(&mask);
+    }
+    size_t n = 0;
+    while (mask_any(&mask)) {
+        n += flat_count_in(tr, flat_child(tr, node, mask_take(&mask)), rect);
+    }
+    return n;
+}
+
+// number of items intersecting the window, the same ones rtree_search would report, without visiting them
+size_t rtree_count_in(struct rtree *tr, const NUMTYPE *min, const NUMTYPE *max) {
+    struct rect rect;
+    memcpy(&rect.min[0], min, sizeof(NUMTYPE) * DIMS);
+    memcpy(&rect.max[0], max ? max : min, sizeof(NUMTYPE) * DIMS);
+    if (tr->map) {
+        return tr->count > 0 && rect_intersects(&tr->rect, &rect) ? flat_count_in(tr, flat_root(tr->map), &rect) : 0;
+    }
+    int slot;
+    struct node *root = reader_lock(tr, &slot);
+    size_t n = 0;
+    if (root && (tr->concurrent || rect_intersects(&tr->rect, &rect))) {
+        n = node_count_in(tr, root, &rect);
+    }
+    reader_unlock(tr, slot);
+    return n;
+}
+
+// adds one node to the totals of its level. the dead space is the node area minus the area of its
+// entries, with the pairwise overlaps added back so shared area is not subtracted twice
+static void stats_node(struct rtree_stats *stats, int level, const struct rect *nr, const struct rect *rects, int count) {
+    struct rect sorted[MAX_ENTRIES]; // by min[0] for the sweep, already so unless the tree is in hilbert mode
+    for (int i = 0; i < count; i++) {
+        int j = i;
+        for (; j > 0 && rects[i].min[0] < sorted[j - 1].min[0]; j--) {
+            sorted[j] = sorted[j - 1];
+        }
+        sorted[j] = rects[i];
+    }
+    double area = 0, overlap = 0;
+    for (int i = 0; i < count; i++) {
+        area += rect_area(&sorted[i]);
+        for (int j = i + 1; j < count && sorted[j].min[0] <= sorted[i].max[0]; j++) {
+            overlap += rect_overlap_area(&sorted[i], &sorted[j]);
+        }
+    }
+    double dead = MAX(rect_area(nr) - area + overlap, 0);
+    stats->nodes++;
+    stats->overlap += overlap;
+    stats->dead_space += dead;
+    if (level < RTREE_STATS_LEVELS) {
+        struct rtree_level_stats *ls = &stats->levels[level];
+        ls->nodes++;
+        ls->entries += count;
+        ls->overlap += overlap;
+        ls->dead_space += dead;
+    }
+}
+
+static void node_stats(struct rtree_stats *stats, struct node *node, const struct rect *nr, int level) {
+    stats_node(stats, level, nr, node->rects, node->count);
+    for (int i = 0; node->kind == BRANCH && i < node->count; i++) {
+        node_stats(stats, node->children[i], &node->rects[i], level + 1);
+    }
+}
+
+// entry boxes of a mapped node, decoded into rects when packed. those of a packed branch are taken as
+// stored, rounded outwards to its grid
+static const struct rect *flat_boxes(const struct rtree *tr, const struct flat_node *node, struct rect *rects) {
+    if (!tr->packed) {
+        return flat_rects(node);
+    }
+    struct flat_leaf leaf = flat_leaf(tr, node);
+    for (int i = 0; i < (int)node->count; i++) {
+        if (node->kind == BRANCH) {
+            flat_box(tr, node, i, &rects[i]);
+        } else {
+            const NUMTYPE *min, *max;
+            flat_entry(&leaf, i, &min, &max);
+            memcpy(rects[i].min, min, sizeof(NUMTYPE) * DIMS);
+            memcpy(rects[i].max, max, sizeof(NUMTYPE) * DIMS);
+        }
+    }
+    return rects;
+}
+
+static void flat_stats(struct rtree_stats *stats, const struct rtree *tr, const struct flat_node *node, const struct rect *nr, int level) {
+    struct rect decoded[MAX_ENTRIES] = { 0 }; // keeps -Wmaybe-uninitialized quiet, it loses track of the count
+    const struct rect *rects = flat_boxes(tr, node, decoded);
+    stats_node(stats, level, nr, rects, node->count);
+    for (int i = 0; node->kind == BRANCH && i < (int)node->count; i++) {
+        flat_stats(stats, tr, flat_child(tr, node, i), &rects[i], level + 1);
+    }
+}
+
+// walks the whole tree to report its shape along with the work counters, meant to be polled by a
+// metrics exporter. writers wait for the walk, searches keep running in concurrent mode
+void rtree_stats(struct rtree *tr, struct rtree_stats *stats) {
+    memset(stats, 0, sizeof(struct rtree_stats));
+    writer_lock(tr);
+    stats->count = tr->count;
+    stats->height = tr->height;
+    bool locked = pool_lock(tr);
+    stats->memory = sizeof(struct rtree) + tr->pool->bytes + tr->map_size +
+        (tr->limbo[0].cap + tr->limbo[1].cap) * sizeof(struct node *);
+    pool_unlock(tr, locked);
+    if (tr->map) {
+        if (tr->count > 0) {
+            flat_stats(stats, tr, flat_root(tr->map), &tr->rect, 0);
+        }
+    } else if (tr->root) {
+        struct rect rect = node_rect_calc(tr->root);
+        node_stats(stats, tr->root, &rect, 0);
+    }
+    writer_unlock(tr);
+    if (stats->nodes > 0) { // every node but the root is an entry of its parent
+        stats->fill = (double)(stats->count + stats->nodes - 1) / ((double)stats->nodes * MAX_ENTRIES);
+    }
+    for (int i = 0; i < RTREE_STATS_LEVELS && stats->levels[i].nodes > 0; i++) {
+        stats->levels[i].fill = (double)stats->levels[i].entries / ((double)stats->levels[i].nodes * MAX_ENTRIES);
+    }
+    stats->counters.nodes_visited = __atomic_load_n(&tr->counters.nodes_visited, __ATOMIC_RELAXED);
+    stats->counters.rect_tests = __atomic_load_n(&tr->counters.rect_tests, __ATOMIC_RELAXED);
+    stats->counters.leaf_hits = __atomic_load_n(&tr->counters.leaf_hits, __ATOMIC_RELAXED);
+    stats->counters.splits = __atomic_load_n(&tr->counters.splits, __ATOMIC_RELAXED);
+    stats->counters.memmove_bytes = __atomic_load_n(&tr->counters.memmove_bytes, __ATOMIC_RELAXED);
+    stats->counters.allocs = __atomic_load_n(&tr->counters.allocs, __ATOMIC_RELAXED);
+}
+
+// squared euclidean distance from the point to the closest point of the box, 0 when the point is inside.
+// orders the same as the distance without a sqrt per entry
+static double rect_box_dist(const NUMTYPE *min, const NUMTYPE *max, const NUMTYPE *point, void *udata) {
+    (void)udata;
+    double dist = 0;
+    for (int i = 0; i < DIMS; i++) {
+        double d = 0;
+        if (point[i] < min[i]) { d = (double)min[i] - (double)point[i]; }
+        if (point[i] > max[i]) { d = (double)point[i] - (double)max[i]; }
+        dist += d * d;
+    }
+    return dist;
+}
+
+// queued node (index == -1) or item (index of the item in the leaf node). node is a struct flat_node on a mapped tree
+struct nearby_entry {
+    double dist;
+    const void *node;
+    int index;
+};
+
+struct nearby_queue {
+    struct nearby_entry *entries;
+    size_t len;
+    size_t cap;
+};
+
+// items go before nodes at equal distance, so they are emitted without expanding more nodes
+static bool nearby_less(struct nearby_entry *a, struct nearby_entry *b) {
+    if (a->dist < b->dist) { return true; }
+    if (a->dist > b->dist) { return false; }
+    return a->index >= 0 && b->index < 0;
+}
+
+static bool nearby_push(struct rtree *tr, struct nearby_queue *q, struct nearby_entry entry) {
+    if (q->len == q->cap) {
+        size_t cap = q->cap ? q->cap * 2 : MAX_ENTRIES * 2;
+        struct nearby_entry *entries = (struct nearby_entry *)tr->malloc(cap * sizeof(struct nearby_entry));
+        if (!entries) { return false; }
+        if (q->entries) {
+            memcpy(entries, q->entries, q->len * sizeof(struct nearby_entry));
+            tr->free(q->entries);
+        }
+        q->entries = entries;
+        q->cap = cap;
+    }
+    size_t i = q->len++;
+    while (i > 0) { // sift up
+        size_t parent = (i - 1) / 2;
+        if (!nearby_less(&entry, &q->entries[parent])) { break; }
+        q->entries[i] = q->entries[parent];
+        i = parent;
+    }
+    q->entries[i] = entry;
+    return true;
+}
+
+static struct nearby_entry nearby_pop(struct nearby_queue *q) {
+    struct nearby_entry top = q->entries[0];
+    struct nearby_entry last = q->entries[--q->len];
+    size_t i = 0;
+    for (;;) { // sift down
+        size_t child = i * 2 + 1;
+        if (child >= q->len) { break; }
+        if (child + 1 < q->len && nearby_less(&q->entries[child + 1], &q->entries[child])) { child++; }
+        if (!nearby_less(&q->entries[child], &last)) { break; }
+        q->entries[i] = q->entries[child];
+        i = child;
+    }
+    q->entries[i] = last;
+    return top;
+}
+
+// corners and data of the item at index of a leaf
+static void nearby_item(const struct rtree *tr, const void *leaf, int index, const NUMTYPE **min, const NUMTYPE **max, DATATYPE *data) {
+    if (tr->map) {
+        const struct flat_node *node = (const struct flat_node *)leaf;
+        struct flat_leaf entries = flat_leaf(tr, node);
+        flat_entry(&entries, index, min, max);
+        memcpy(data, &flat_refs(node, tr->packed)[index], sizeof(DATATYPE));
+        return;
+    }
+    const struct node *node = (const struct node *)leaf;
+    *min = node->rects[index].min;
+    *max = node->rects[index].max;
+    *data = node->items[index].data;
+}
+
+// queues the entries of a mapped node. packed branch boxes are widened to the grid, so their distance stays a lower bound
+static bool nearby_flat_expand(struct rtree *tr, struct nearby_queue *q, const struct flat_node *node, const NUMTYPE *point, double (*dist)(const NUMTYPE *min, const NUMTYPE *max, const NUMTYPE *point, void *udata), void *udata) {
+    struct flat_leaf leaf;
+    if (node->kind == LEAF) {
+        leaf = flat_leaf(tr, node);
+    }
+    for (int i = 0; i < (int)node->count; i++) {
+        struct nearby_entry next = { .node = node, .index = i };
+        if (node->kind == LEAF) {
+            const NUMTYPE *min, *max;
+            flat_entry(&leaf, i, &min, &max);
+            next.dist = dist(min, max, point, udata);
+        } else {
+            struct rect decoded;
+            const struct rect *box = flat_box(tr, node, i, &decoded);
+            next.dist = dist(box->min, box->max, point, udata);
+            next.node = flat_child(tr, node, i);
+            next.index = -1;
+        }
+        if (!nearby_push(tr, q, next)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// best-first traversal by distance to the point, items are passed to iter in ascending distance order.
+// dist must never be larger for a box than for any box contained in it. k == 0 means no limit. without
+// dist the distance is the squared euclidean one, iter receives it squared
+bool rtree_nearby_with_dist(struct rtree *tr, const NUMTYPE *point, size_t k, double (*dist)(const NUMTYPE *min, const NUMTYPE *max, const NUMTYPE *point, void *udata), bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data, double dist, void *udata), void *udata) {
+    if (!dist) dist = rect_box_dist;
+    int slot;
+    const void *root = reader_lock(tr, &slot);
+    if (tr->map && tr->count > 0) {
+        root = flat_root(tr->map);
+    }
+    if (!root) {
+        reader_unlock(tr, slot);
+        return true;
+    }
+    struct nearby_queue q = { 0 };
+    bool ok = nearby_push(tr, &q, (struct nearby_entry){ .dist = 0, .node = root, .index = -1 });
+    size_t found = 0;
+    while (ok && q.len > 0 && (k == 0 || found < k)) {
+        struct nearby_entry entry = nearby_pop(&q);
+        if (entry.index >= 0) {
+            const NUMTYPE *min, *max;
+            DATATYPE data;
+            nearby_item(tr, entry.node, entry.index, &min, &max, &data);
+            found++;
+            STAT(tr, leaf_hits, 1);
+            if (!iter(min, max, data, entry.dist, udata)) {
+                break;
+            }
+            continue;
+        }
+        STAT(tr, nodes_visited, 1);
+        if (tr->map) {
+            STAT(tr, rect_tests, ((const struct flat_node *)entry.node)->count);
+            ok = nearby_flat_expand(tr, &q, (const struct flat_node *)entry.node, point, dist, udata);
+            continue;
+        }
+        const struct node *node = (const struct node *)entry.node;
+        STAT(tr, rect_tests, node->count);
+        for (int i = 0; i < node->count && ok; i++) {
+            struct nearby_entry next = { .dist = dist(node->rects[i].min, node->rects[i].max, point, udata) };
+            if (node->kind == LEAF) {
+                next.node = node;
+                next.index = i;
+            } else {
+                next.node = node->children[i];
+                next.index = -1;
+            }
+            ok = nearby_push(tr, &q, next);
+        }
+    }
+    if (q.entries) { tr->free(q.entries); }
+    reader_unlock(tr, slot);
+    return ok;
+}
+
+bool rtree_nearby(struct rtree *tr, const NUMTYPE *point, size_t k, bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data, double dist, void *udata), void *udata) {
+    return rtree_nearby_with_dist(tr, point, k, NULL, iter, udata);
+}
+
+// moves the entry at index from one node into another node of the same level
+static void node_move_entry(struct node *from, int index, struct node *into) {
+    into->rects[into->count] = from->rects[index];
+    if (from->kind == LEAF) {
+        into->items[into->count] = from->items[index];
+    } else {
+        into->children[into->count] = from->children[index];
+        into->total += node_total(from->children[index]);
+        from->total -= node_total(from->children[index]);
+    }
+    into->count++;
+    from->count--;
+    from->rects[index] = from->rects[from->count];
+    if (from->kind == LEAF) {
+        from->items[index] = from->items[from->count];
+    } else {
+        from->children[index] = from->children[from->count];
+    }
+}
+
+// hilbert mode condensing: the underfull child at index is merged with a neighbour that has room for it, or takes
+// the entries next to it from a neighbour that can spare them, so the children stay in key order
+static bool node_condense_hilbert(struct rtree *tr, struct node *node, int index) {
+    struct node *child = node->children[index];
+    int need = MIN_ENTRIES - child->count;
+    int merge = -1, borrow = -1;
+    for (int j = index - 1; j <= index + 1; j += 2) {
+        if (j < 0 || j >= node->count) {
+            continue;
+        }
+        if (merge == -1 && node->children[j]->count + child->count <= MAX_ENTRIES) {
+            merge = j;
+        }
+        if (borrow == -1 && node->children[j]->count - need >= MIN_ENTRIES) {
+            borrow = j;
+        }
+    }
+    int j = merge != -1 ? merge : borrow;
+    if (j == -1) {
+        return false;
+    }
+    struct node *sibling = node_mut(tr, node->children[j]);
+    if (!sibling) {
+        return false;
+    }
+    node->children[j] = sibling;
+    if (merge != -1) { // the right one of the two is appended to the left one
+        int left = MIN(index, j), right = MAX(index, j);
+        struct node *into = node->children[left], *from = node->children[right];
+        node_copy_entries(tr, into, into->count, from, 0, from->count);
+        into->count += from->count;
+        from->count = 0;
+        node_free(tr, from);
+        node->rects[left] = node_rect_calc(into);
+        node->keys[left] = node_key(into);
+        node_copy_entries(tr, node, right, node, right + 1, node->count - (right + 1));
+        node->count--;
+        return true;
+    }
+    if (j > index) { // the first entries of the right neighbour
+        node_copy_entries(tr, child, child->count, sibling, 0, need);
+        node_copy_entries(tr, sibling, 0, sibling, need, sibling->count - need);
+    } else {         // the last entries of the left neighbour
+        node_copy_entries(tr, child, need, child, 0, child->count);
+        node_copy_entries(tr, child, 0, sibling, sibling->count - need, need);
+    }
+    child->count += need;
+    sibling->count -= need;
+    node->rects[index] = node_rect_calc(child);
+    node->keys[index] = node_key(child);
+    node->rects[j] = node_rect_calc(sibling);
+    node->keys[j] = node_key(sibling);
+    return true;
+}
+
+// fixes the underflow of the child at index, it is merged into the sibling that grows least and has room for it,
+// otherwise it borrows the entries closest to it from the sibling that grows it least and can spare them.
+// returns false when the node is left as is
+static bool node_condense(struct rtree *tr, struct node *node, int index) {
+    if (tr->hilbert) {
+        return node_condense_hilbert(tr, node, index);
+    }
+    struct node *child = node->children[index];
+    int need = MIN_ENTRIES - child->count;
+    int merge = -1, borrow = -1;
+    double merge_enl = 0, borrow_enl = 0;
+    for (int i = 0; i < node->count; i++) {
+        if (i == index) {
+            continue;
+        }
+        double enl = rect_unioned_area(&node->rects[i], &node->rects[index]) - rect_area(&node->rects[i]);
+        if (node->children[i]->count + child->count <= MAX_ENTRIES && (merge == -1 || enl < merge_enl)) {
+            merge = i;
+            merge_enl = enl;
+        }
+        enl = rect_unioned_area(&node->rects[i], &node->rects[index]) - rect_area(&node->rects[index]);
+        if (node->children[i]->count - need >= MIN_ENTRIES && (borrow == -1 || enl < borrow_enl)) {
+            borrow = i;
+            borrow_enl = enl;
+        }
+    }
+    int j = merge != -1 ? merge : borrow;
+    if (j == -1) {
+        return false;
+    }
+    struct node *sibling = node_mut(tr, node->children[j]);
+    if (!sibling) {
+        return false;
+    }
+    node->children[j] = sibling;
+    if (merge != -1) {
+        while (child->count > 0) {
+            node_move_entry(child, 0, sibling);
+        }
+        node_free(tr, child);
+        node->rects[j] = node_rect_calc(sibling);
+        node->count--;
+        node->rects[index] = node->rects[node->count];
+        node->children[index] = node->children[node->count];
+        node_sort(sibling);
+    } else {
+        for (int k = 0; k < need; k++) {
+            struct rect crect = node_rect_calc(child);
+            int best = 0;
+            double best_enl = 0;
+            for (int i = 0; i < sibling->count; i++) {
+                double enl = rect_unioned_area(&crect, &sibling->rects[i]) - rect_area(&crect);
+                if (i == 0 || enl < best_enl) {
+                    best = i;
+                    best_enl = enl;
+                }
+            }
+            node_move_entry(sibling, best, child);
+        }
+        node->rects[index] = node_rect_calc(child);
+        node->rects[j] = node_rect_calc(sibling);
+        node_sort(child);
+        node_sort(sibling);
+    }
+    node_sort(node);
+    return true;
+}
+
+static void node_delete(struct rtree *tr, struct rect *nr, struct node *node, struct rect *ir, struct item item, bool *removed, bool *shrunk, int (*compare)(const DATATYPE a, const DATATYPE b, void *udata), void *udata) {
+    *removed = false;
+    *shrunk = false;
+    STAT(tr, nodes_visited, 1);
+    if (node->kind == LEAF) {
+        for (int i = 0; i < node->count; i++) {
+            STAT(tr, rect_tests, 1);
+            if (!rect_contains(ir, &node->rects[i])) {
+                continue;
+            }
+            int cmp = compare ?
+                compare(node->items[i].data, item.data, udata) :
+                memcmp(&node->items[i].data, &item.data, sizeof(DATATYPE));
+            if (cmp != 0) {
+                continue;
+            }
+            // found the target item to delete
+            STAT(tr, memmove_bytes, (node->count - (i + 1)) * (sizeof(struct rect) + sizeof(struct item)));
+            node_copy_entries(tr, node, i, node, i + 1, node->count - (i + 1));
+            node->count--;
+            if (rect_onedge(ir, nr)) {      // item was on the edge of node rect
+                *nr = node_rect_calc(node); // recalculation of node rect
+                *shrunk = true;             // notify the caller that rect is shrunk
+            }
+            *removed = true;
+            return;
+        }
+        return;
+    }
+    for (int i = 0; i < node->count; i++) {
+        STAT(tr, rect_tests, 1);
+        if (!rect_contains(&node->rects[i], ir)) {
+            continue;
+        }
+        struct rect crect = node->rects[i];
+        node_delete(tr, &node->rects[i], node->children[i], ir, item, removed, shrunk, compare, udata);
+        if (!*removed) {
+            continue;
+        }
+        node->total--;
+        if (node->children[i]->count == 0) { // underflow
+            node_free(tr, node->children[i]);
+            STAT(tr, memmove_bytes, (node->count - (i + 1)) * (sizeof(struct rect) + sizeof(struct node *)));
+            node_copy_entries(tr, node, i, node, i + 1, node->count - (i + 1));
+            node->count--;
+            *nr = node_rect_calc(node);
+            *shrunk = true;
+            return;
+        }
+        if (tr->hilbert) { // the largest key may have gone
+            node->keys[i] = node_key(node->children[i]);
+        }
+        if (node->children[i]->count < MIN_ENTRIES && node_condense(tr, node, i)) {
+            *nr = node_rect_calc(node);
+            *shrunk = true;
+            return;
+        }
+        if (*shrunk) {
+            *shrunk = !rect_equals(&node->rects[i], &crect);
+            if (*shrunk) {
+                *nr = node_rect_calc(node);
+            }
+            if (!tr->hilbert) {
+                node_order_to_right(node, i);
+            }
+        }
+        return;
+    }
+    return;
+}
+
+// finds the item the way node_delete probes for it and records the child taken at every level, then the item index
+static bool node_find_path(struct node *node, struct rect *ir, struct item item, int *path, int (*compare)(const DATATYPE a, const DATATYPE b, void *udata), void *udata) {
+    for (int i = 0; i < node->count; i++) {
+        if (node->kind == LEAF) {
+            if (!rect_contains(ir, &node->rects[i])) {
+                continue;
+            }
+            int cmp = compare ?
+                compare(node->items[i].data, item.data, udata) :
+                memcmp(&node->items[i].data, &item.data, sizeof(DATATYPE));
+            if (cmp == 0) {
+                *path = i;
+                return true;
+            }
+        } else if (rect_contains(&node->rects[i], ir)) {
+            *path = i;
+            if (node_find_path(node->children[i], ir, item, path + 1, compare, udata)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// copies the published nodes on the path found by node_find_path, so the writer only modifies nodes it owns,
+// nodes[i] receives the node at depth i
+static bool tree_mut_path(struct rtree *tr, int *path, struct node **nodes) {
+    struct node *node = node_mut(tr, tr->root);
+    if (!node) { return false; }
+    tr->root = node;
+    nodes[0] = node;
+    for (int i = 0; i < tr->height; i++) {
+        struct node *child = node_mut(tr, node->children[path[i]]);
+        if (!child) { return false; }
+        node->children[path[i]] = child;
+        node = child;
+        nodes[i + 1] = node;
+    }
+    return true;
+}
+
+// returns false when the path to the item could not be copied, an item that is not found is no failure
+static bool tree_delete(struct rtree *tr, struct rect *rect, struct item item) {
+    if (!tr->root) { return true; }
+    bool removed = false, shrunk = false;
+    if (tr->concurrent || pool_shared(tr)) { // node_delete modifies nodes in place, copy the path first
+        int path[64];
+        struct node *nodes[64];
+        if (tr->height >= 64) { return false; }
+        if (!node_find_path(tr->root, rect, item, path, NULL, NULL)) { return true; }
+        if (!tree_mut_path(tr, path, nodes)) { return false; }
+    }
+    node_delete(tr, &tr->rect, tr->root, rect, item, &removed, &shrunk, NULL, NULL);
+    if (!removed) {
+        return true;
+    }
+    tr->count--;
+    if (tr->count == 0) {
+        node_free(tr, tr->root);
+        tr->root = NULL;
+        tr->height = 0;
         memset(&tr->rect, 0, sizeof(struct rect));
     } else {
-        while (tr->root->kind == BRANCH && tr->root->count == 1) {
-            struct node *prev = tr->root;
-            tr->root = tr->root->children[0];
-            prev->count = 0;
-            node_free(tr, prev);
+        while (tr->root->kind == BRANCH && tr->root->count == 1) {
+            struct node *prev = tr->root;
+            tr->root = tr->root->children[0];
+            tr->height--;
+            prev->count = 0;
+            node_free(tr, prev);
+        }
+        if (shrunk) {
+            tr->rect = node_rect_calc(tr->root);
+        }
+    }
+    return true;
+}
+
+// search the tree for an item contained within provided rect, perform a binary comparison of its data to provided, first item found is deleted.
+// returns false when out of memory, which only happens in concurrent mode or on trees sharing nodes with a clone, or on a mapped
+// tree. an item that is not found leaves the tree as it is and returns true
+bool rtree_delete(struct rtree *tr, const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data) {
+    struct rect rect;
+    memcpy(&rect.min[0], min, sizeof(NUMTYPE) * DIMS);
+    memcpy(&rect.max[0], max ? max : min, sizeof(NUMTYPE) * DIMS);
+    struct item item;
+    memcpy(&item.data, &data, sizeof(DATATYPE));
+    if (tr->map) { return false; }
+    writer_lock(tr);
+    bool ok = tree_delete(tr, &rect, item);
+    writer_unlock(tr);
+    return ok;
+}
+
+// moves the item in place when the new rect stays within the rect its leaf has in the parent,
+// the leaf entry is resorted and the ancestors the old rect was touching are shrunk bottom-up
+static bool tree_update(struct rtree *tr, struct rect *old, struct rect *rect, struct item item) {
+    if (tr->hilbert) { // the key follows the center, the entry has to move to its new place in key order
+        return tree_delete(tr, old, item) && tree_insert(tr, rect, item);
+    }
+    int path[64];
+    if (!tr->root || tr->height >= 64 || !node_find_path(tr->root, old, item, path, NULL, NULL)) {
+        return tree_insert(tr, rect, item);
+    }
+    struct node *node = tr->root;
+    struct rect *bound = &tr->rect;
+    for (int i = 0; i < tr->height; i++) {
+        bound = &node->rects[path[i]];
+        node = node->children[path[i]];
+    }
+    if (!rect_contains(bound, rect)) { // the leaf would grow, move the item to a better place
+        return tree_delete(tr, old, item) && tree_insert(tr, rect, item);
+    }
+    struct node *nodes[64];
+    if (!tree_mut_path(tr, path, nodes)) {
+        return false;
+    }
+    node = nodes[tr->height];
+    int index = path[tr->height];
+    struct rect prev = node->rects[index];
+    node->rects[index] = *rect;
+    if (node_order_to_left(node, index) == index) {
+        node_order_to_right(node, index);
+    }
+    for (int h = tr->height; h >= 0; h--) {
+        struct rect *nr = h > 0 ? &nodes[h - 1]->rects[path[h - 1]] : &tr->rect;
+        if (!rect_onedge(&prev, nr)) {
+            break;
+        }
+        struct rect calc = node_rect_calc(nodes[h]);
+        if (rect_equals(&calc, nr)) {
+            break;
+        }
+        prev = *nr;
+        *nr = calc;
+        if (h > 0) { // the rect only shrank, so its min[0] can only have moved right
+            node_order_to_right(nodes[h - 1], path[h - 1]);
+        }
+    }
+    return true;
+}
+
+// moves the item found the way rtree_delete finds it from the old rect to the new one, an item that is not found is inserted
+bool rtree_update(struct rtree *tr, const NUMTYPE *old_min, const NUMTYPE *old_max, const NUMTYPE *new_min, const NUMTYPE *new_max, const DATATYPE data) {
+    struct rect old, rect;
+    memcpy(&old.min[0], old_min, sizeof(NUMTYPE) * DIMS);
+    memcpy(&old.max[0], old_max ? old_max : old_min, sizeof(NUMTYPE) * DIMS);
+    memcpy(&rect.min[0], new_min, sizeof(NUMTYPE) * DIMS);
+    memcpy(&rect.max[0], new_max ? new_max : new_min, sizeof(NUMTYPE) * DIMS);
+    struct item item;
+    memcpy(&item.data, &data, sizeof(DATATYPE));
+    if (tr->map) { return false; }
+    writer_lock(tr);
+    bool ok = tree_update(tr, &old, &rect, item);
+    writer_unlock(tr);
+    return ok;
+}
+
+// restores the order of a node whose entries moved little, cheaper than node_sort on an almost sorted node
+static void node_resort(struct node *node) {
+    for (int i = 1; i < node->count; i++) {
+        node_order_to_left(node, i);
+    }
+}
+
+#define INGEST_NODES(_n_) (((_n_) + MAX_ENTRIES - 1) / MAX_ENTRIES)
+
+#if MAX_ENTRIES > 255
+#define ROUTE_TYPE uint16_t // child indexes of wider nodes take two bytes
+#else
+#define ROUTE_TYPE unsigned char
+#endif
+
+// batch insert: the batch is routed down the tree in groups, then every node that received entries is
+// updated once in place, only overflowing nodes are cut into as many nodes as their entries need
+struct ingest {
+    struct rtree *tr;
+    struct bulk_entry *entries; // the batch, grouped by node. in key order within every group in hilbert mode
+    struct bulk_entry *tmp;     // room for regrouping a range of the batch
+    ROUTE_TYPE *route;          // child taken by each entry at every branch level, n per level
+    size_t n;
+    size_t allocs;              // nodes the rebuild allocates
+    struct bulk_entry *out;     // entries of the nodes being rebuilt along the current path
+    size_t len;
+};
+
+// first pass, changes nothing: routes the range [lo, hi) of the batch through the subtree the way single
+// inserts would choose, and groups it by child. returns the number of nodes the subtree is rebuilt into,
+// *peak receives the room the rebuild needs in the out list. the children of a node that gets copied
+// are shared by the copy and the original, so they are copied as well
+static size_t ingest_plan(struct ingest *in, struct node *node, bool shared, int depth, size_t lo, size_t hi, size_t *peak) {
+    struct rtree *tr = in->tr;
+    shared = shared || node_shared(tr, node);
+    if (node->kind == LEAF) {
+        size_t total = node->count + (hi - lo);
+        *peak = total;
+        if (total <= MAX_ENTRIES) {
+            in->allocs += shared;
+            return 1;
+        }
+        in->allocs += INGEST_NODES(total);
+        return INGEST_NODES(total);
+    }
+    struct node grown; // rects widened as entries are routed, as sequential inserts would
+    if (!tr->hilbert) {
+        memcpy(&grown, node, NODE_BYTES(false));
+    }
+    ROUTE_TYPE *route = &in->route[depth * in->n];
+    size_t counts[MAX_ENTRIES + 1] = { 0 };
+    for (size_t k = lo; k < hi; k++) {
+        int i;
+        if (tr->hilbert) { // by key, the way node_insert_hilbert descends
+            i = MIN(node_key_search(node, in->entries[k].key), node->count - 1);
+        } else {
+            i = node_choose_subtree(tr, &grown, &in->entries[k].rect);
+            rect_expand(&grown.rects[i], &in->entries[k].rect);
+        }
+        route[k] = (ROUTE_TYPE)i;
+        counts[i + 1]++;
+    }
+    for (int i = 0; i < node->count; i++) {
+        counts[i + 1] += counts[i];
+    }
+    for (size_t k = lo; k < hi; k++) {
+        in->tmp[lo + counts[route[k]]++] = in->entries[k];
+    }
+    memcpy(&in->entries[lo], &in->tmp[lo], (hi - lo) * sizeof(struct bulk_entry));
+    size_t total = node->count, child_peak = 0, k = lo;
+    for (int i = 0; i < node->count; i++) { // counts[i] is now the end of the group of child i
+        size_t e = lo + counts[i];
+        if (e == k) {
+            continue;
+        }
+        for (size_t r = k; r < e; r++) {
+            route[r] = (ROUTE_TYPE)i;
+        }
+        size_t p;
+        total += ingest_plan(in, node->children[i], shared, depth + 1, k, e, &p) - 1;
+        child_peak = MAX(child_peak, p);
+        k = e;
+    }
+    *peak = total + child_peak;
+    in->allocs += shared;
+    if (total <= MAX_ENTRIES) {
+        return 1;
+    }
+    in->allocs += INGEST_NODES(total);
+    return INGEST_NODES(total);
+}
+
+// stores the rebuilt node and its rect as entry at of the out list
+static void ingest_set(struct ingest *in, size_t at, struct node *node, const struct rect *rect) {
+    in->out[at].rect = *rect;
+    in->out[at].child = node;
+    if (in->tr->hilbert) {
+        in->out[at].key = node_key(node);
+    }
+}
+
+// cuts the n entries at out[start] into the given number of evenly filled nodes, halving the nodes at the
+// median of the longest axis every time, or in key order in hilbert mode. the nodes are appended to out at
+// *at, which never passes start
+static void ingest_cut(struct ingest *in, size_t start, size_t n, size_t nodes, enum kind kind, size_t *at) {
+    struct bulk_entry *entries = &in->out[start];
+    if (nodes == 1) {
+        struct node *node = node_new(in->tr, kind);
+        node_fill(in->tr, node, entries, n);
+        if (!in->tr->hilbert) {
+            node_sort(node);
+        }
+        struct rect rect = node_rect_calc(node);
+        ingest_set(in, (*at)++, node, &rect);
+        return;
+    }
+    if (!in->tr->hilbert) {
+        struct rect bounds = entries[0].rect;
+        for (size_t i = 1; i < n; i++) {
+            rect_expand(&bounds, &entries[i].rect);
+        }
+        bulk_qsort(entries, n, rect_largest_axis(&bounds));
+    }
+    size_t half = nodes / 2, m = n * half / nodes;
+    ingest_cut(in, start, m, half, kind, at);
+    ingest_cut(in, start + m, n - m, nodes - half, kind, at);
+}
+
+// replaces out[start..len) with the nodes its entries are cut into
+static void ingest_pack(struct ingest *in, size_t start, enum kind kind) {
+    size_t at = start;
+    ingest_cut(in, start, in->len - start, INGEST_NODES(in->len - start), kind, &at);
+    in->len = at;
+}
+
+// inserts the entry into a node with room for it, in key order in hilbert mode and in min[0] order otherwise.
+// the total of a branch is left to the caller
+static void node_add_entry(struct rtree *tr, struct node *node, const struct bulk_entry *e) {
+    int index = tr->hilbert ? node_key_search(node, e->key) : node_rsearch(node, e->rect.min[0]);
+    STAT(tr, memmove_bytes, (node->count - index) * (sizeof(struct rect) + sizeof(struct item)));
+    node_copy_entries(tr, node, index + 1, node, index, node->count - index);
+    node->count++;
+    node->rects[index] = e->rect;
+    if (node->kind == LEAF) {
+        node->items[index] = e->item;
+    } else {
+        node->children[index] = e->child;
+    }
+    if (tr->hilbert) {
+        node->keys[index] = e->key;
+    }
+}
+
+// rect of a node that took the range [lo, hi) of the batch without being cut, inserts only widen it
+static struct rect ingest_grown(struct ingest *in, const struct rect *rect, size_t lo, size_t hi) {
+    struct rect grown = *rect;
+    for (size_t k = lo; k < hi; k++) {
+        rect_expand(&grown, &in->entries[k].rect);
+    }
+    return grown;
+}
+
+// second pass, cannot fail since the nodes were reserved: appends the nodes the subtree is rebuilt into to out.
+// rect is the node's rect in its parent
+static void ingest_apply(struct ingest *in, struct node *node, const struct rect *rect, int depth, size_t lo, size_t hi) {
+    struct rtree *tr = in->tr;
+    size_t start = in->len;
+    if (node->kind == LEAF) {
+        if (node->count + (hi - lo) <= MAX_ENTRIES) {
+            node = node_mut(tr, node);
+            for (size_t k = lo; k < hi; k++) {
+                node_add_entry(tr, node, &in->entries[k]);
+            }
+            struct rect grown = ingest_grown(in, rect, lo, hi);
+            ingest_set(in, in->len++, node, &grown);
+            return;
+        }
+        int i = 0;
+        size_t k = lo;
+        while (i < node->count || k < hi) { // the node's entries then the group, merged by key in hilbert mode
+            if (k < hi && (i == node->count || (tr->hilbert && in->entries[k].key < node->keys[i]))) {
+                in->out[in->len++] = in->entries[k++];
+                continue;
+            }
+            in->out[in->len].rect = node->rects[i];
+            in->out[in->len].item = node->items[i];
+            if (tr->hilbert) {
+                in->out[in->len].key = node->keys[i];
+            }
+            in->len++;
+            i++;
+        }
+        ingest_pack(in, start, LEAF);
+        node_retire(tr, node);
+        return;
+    }
+    node = node_mut(tr, node);
+    ROUTE_TYPE *route = &in->route[depth * in->n];
+    for (size_t k = lo; k < hi; k++) {
+        if (k == lo || route[k] != route[k - 1]) {
+            node_prefetch(node->children[route[k]]);
+        }
+    }
+    for (size_t k = lo; k < hi; ) { // the first node a child is rebuilt into takes its place, the others wait in out
+        int i = route[k];
+        size_t e = k, at = in->len;
+        while (e < hi && route[e] == i) { e++; }
+        ingest_apply(in, node->children[i], &node->rects[i], depth + 1, k, e);
+        node->rects[i] = in->out[at].rect;
+        node->children[i] = in->out[at].child;
+        if (tr->hilbert) { // the keys routed to a child never pass the next child's, so the order holds
+            node->keys[i] = in->out[at].key;
+        }
+        in->len--;
+        memmove(&in->out[at], &in->out[at + 1], (in->len - at) * sizeof(struct bulk_entry));
+        k = e;
+    }
+    size_t waiting = in->len - start;
+    if (node->count + waiting <= MAX_ENTRIES) {
+        node->total += hi - lo;
+        if (!tr->hilbert) {
+            node_resort(node);
+        }
+        for (size_t j = start; j < in->len; j++) {
+            node_add_entry(tr, node, &in->out[j]);
+        }
+        struct rect grown = ingest_grown(in, rect, lo, hi);
+        in->len = start;
+        ingest_set(in, in->len++, node, &grown);
+        return;
+    }
+    // the children go in front of the waiting nodes, merged with them by key in hilbert mode
+    memmove(&in->out[start + node->count], &in->out[start], waiting * sizeof(struct bulk_entry));
+    size_t w = start, b = start + node->count;
+    in->len = b + waiting;
+    for (int i = 0; i < node->count; i++) {
+        while (tr->hilbert && b < in->len && in->out[b].key < node->keys[i]) {
+            in->out[w++] = in->out[b++];
+        }
+        in->out[w].rect = node->rects[i];
+        in->out[w].child = node->children[i];
+        if (tr->hilbert) {
+            in->out[w].key = node->keys[i];
+        }
+        w++;
+    }
+    ingest_pack(in, start, BRANCH);
+    node->count = 0; // the children moved to the packed nodes
+    node_free(tr, node);
+}
+
+// inserts the n entries as one batch and consumes them, the tree is left as it was when memory runs out
+static bool tree_insert_entries(struct rtree *tr, struct bulk_entry *entries, size_t n) {
+    struct ingest in = { .tr = tr, .n = n, .entries = entries };
+    if (!tr->root) {
+        return bulk_build(tr, in.entries, n);
+    }
+    bool ok = false;
+    in.tmp = (struct bulk_entry *)tr->malloc(n * sizeof(struct bulk_entry));
+    in.route = (ROUTE_TYPE *)tr->malloc(tr->height > 0 ? n * tr->height * sizeof(ROUTE_TYPE) : 1);
+    if (!in.tmp || !in.route || (tr->hilbert && !hilbert_sort(tr, in.entries, in.tmp, n))) {
+        goto done;
+    }
+    size_t peak;
+    size_t nodes = ingest_plan(&in, tr->root, false, 0, 0, n, &peak);
+    for (size_t r = nodes; r > 1; ) { // new root levels
+        r = INGEST_NODES(r);
+        in.allocs += r;
+    }
+    in.out = (struct bulk_entry *)tr->malloc(peak * sizeof(struct bulk_entry));
+    if (!in.out || !pool_reserve(tr, in.allocs)) {
+        goto done;
+    }
+    ingest_apply(&in, tr->root, &tr->rect, 0, 0, n);
+    while (in.len > 1) {
+        ingest_pack(&in, 0, BRANCH);
+        tr->height++;
+    }
+    tr->root = in.out[0].child;
+    tr->rect = in.out[0].rect;
+    tr->count += n;
+    ok = true;
+done:
+    pool_unreserve(tr);
+    if (in.out) { tr->free(in.out); }
+    if (in.route) { tr->free(in.route); }
+    if (in.tmp) { tr->free(in.tmp); }
+    tr->free(in.entries);
+    return ok;
+}
+
+static bool tree_insert_batch(struct rtree *tr, const struct rect *rects, DATATYPE const *items, size_t n) {
+    struct bulk_entry *entries = (struct bulk_entry *)tr->malloc(n * sizeof(struct bulk_entry));
+    if (!entries) { return false; }
+    for (size_t i = 0; i < n; i++) {
+        entries[i].rect = rects[i];
+        memcpy(&entries[i].item.data, &items[i], sizeof(DATATYPE));
+    }
+    return tree_insert_entries(tr, entries, n);
+}
+
+// inserts n rects at once. the batch is pushed down the tree in groups, every node it reaches is updated
+// once and overflowing nodes are repacked instead of split entry by entry. nothing is inserted when memory
+// runs out, the nodes needed are reserved before the tree changes
+bool rtree_insert_batch(struct rtree *tr, const struct rect *rects, DATATYPE const *items, size_t n) {
+    if (n == 0) { return true; }
+    if (tr->map) { return false; }
+    writer_lock(tr);
+    bool ok = tree_insert_batch(tr, rects, items, n);
+    writer_unlock(tr);
+    return ok;
+}
+
+// batch delete: the batch is offered to every child whose rect contains an entry, until the entry is found
+struct purge {
+    struct rtree *tr;
+    struct bulk_entry *entries;
+    bool *found;
+    size_t *lists;              // entries offered to the node at every depth, n per level
+    size_t n;
+    size_t removed;
+    bool oom;
+};
+
+// node on the way down of node_delete_batch, shared nodes are only copied once an entry is found below them
+struct purge_frame {
+    struct node *node;
+    struct purge_frame *parent;
+    int index;                  // of the node in the parent
+    bool owned;                 // the node and its ancestors may be modified
+};
+
+// makes the node of the frame the writer's own, its ancestors first since the children of a shared node
+// are shared along with it. returns false when out of memory
+static bool purge_mut(struct purge *pg, struct purge_frame *f) {
+    if (f->owned) {
+        return true;
+    }
+    if (f->parent && !purge_mut(pg, f->parent)) {
+        return false;
+    }
+    struct node *node = node_mut(pg->tr, f->node);
+    if (!node) {
+        return false;
+    }
+    if (f->parent) {
+        f->parent->node->children[f->index] = node;
+    } else {
+        pg->tr->root = node;
+    }
+    f->node = node;
+    f->owned = true;
+    return true;
+}
+
+// removes the offered entries found in the subtree, then fixes the children it changed in one go
+static bool node_delete_batch(struct purge *pg, struct purge_frame *f, int depth, size_t len) {
+    struct rtree *tr = pg->tr;
+    struct node *node = f->node;
+    size_t *list = &pg->lists[depth * pg->n];
+    if (node->kind == LEAF) {
+        bool removed = false;
+        for (size_t k = 0; k < len; k++) {
+            struct bulk_entry *e = &pg->entries[list[k]];
+            for (int i = 0; i < node->count; i++) {
+                STAT(tr, rect_tests, 1);
+                if (!rect_contains(&e->rect, &node->rects[i]) || memcmp(&node->items[i].data, &e->item.data, sizeof(DATATYPE))) {
+                    continue;
+                }
+                if (!purge_mut(pg, f)) {
+                    pg->oom = true;
+                    return removed;
+                }
+                node = f->node;
+                STAT(tr, memmove_bytes, (node->count - (i + 1)) * (sizeof(struct rect) + sizeof(struct item)));
+                node_copy_entries(tr, node, i, node, i + 1, node->count - (i + 1));
+                node->count--;
+                pg->found[list[k]] = true;
+                pg->removed++;
+                removed = true;
+                break;
+            }
         }
-        if (shrunk) {
+        return removed;
+    }
+    size_t *sub = &pg->lists[(depth + 1) * pg->n];
+    bool changed = false;
+    for (int i = 0; i < node->count; i++) {
+        size_t sublen = 0;
+        for (size_t k = 0; k < len; k++) {
+            STAT(tr, rect_tests, 1);
+            if (!pg->found[list[k]] && rect_contains(&node->rects[i], &pg->entries[list[k]].rect)) {
+                sub[sublen++] = list[k];
+            }
+        }
+        if (sublen == 0) {
+            continue;
+        }
+        struct purge_frame sf = { .node = node->children[i], .parent = f, .index = i };
+        size_t total = node_total(sf.node);
+        bool removed = node_delete_batch(pg, &sf, depth + 1, sublen);
+        node = f->node; // may have been copied by purge_mut below
+        if (removed) {
+            struct node *child = sf.node;
+            node->total -= total - node_total(child);
+            if (child->count > 0) {
+                node->rects[i] = node_rect_calc(child);
+                if (tr->hilbert) {
+                    node->keys[i] = node_key(child);
+                }
+            }
+            changed = true;
+        }
+    }
+    if (!changed) {
+        return false;
+    }
+    int count = 0;
+    for (int i = 0; i < node->count; i++) {
+        if (node->children[i]->count == 0) {
+            node_free(tr, node->children[i]);
+            continue;
+        }
+        node_copy_entries(tr, node, count++, node, i, 1);
+    }
+    node->count = count;
+    if (!tr->hilbert) {
+        node_resort(node);
+    }
+    for (int i = 0; i < node->count; i++) {
+        if (node->children[i]->count >= MIN_ENTRIES) {
+            continue;
+        }
+        struct node *child = node_mut(tr, node->children[i]);
+        if (!child) {
+            pg->oom = true;
+            continue;
+        }
+        node->children[i] = child;
+        if (node_condense(tr, node, i)) {
+            i = -1; // the node was resorted
+        }
+    }
+    return true;
+}
+
+static bool tree_delete_batch(struct rtree *tr, const struct rect *rects, DATATYPE const *items, size_t n) {
+    if (!tr->root) { return true; }
+    struct purge pg = { .tr = tr, .n = n };
+    pg.entries = (struct bulk_entry *)tr->malloc(n * sizeof(struct bulk_entry));
+    pg.found = (bool *)tr->malloc(n * sizeof(bool));
+    pg.lists = (size_t *)tr->malloc(n * (tr->height + 1) * sizeof(size_t));
+    struct bulk_entry *tmp = (struct bulk_entry *)tr->malloc(n * sizeof(struct bulk_entry));
+    bool ok = pg.entries && pg.found && pg.lists && tmp;
+    if (ok) {
+        for (size_t i = 0; i < n; i++) {
+            pg.entries[i].rect = rects[i];
+            memcpy(&pg.entries[i].item.data, &items[i], sizeof(DATATYPE));
+        }
+        ok = hilbert_sort(tr, pg.entries, tmp, n);
+    }
+    if (tmp) { tr->free(tmp); }
+    if (ok) {
+        struct purge_frame root = { .node = tr->root };
+        memset(pg.found, 0, n * sizeof(bool));
+        for (size_t i = 0; i < n; i++) {
+            pg.lists[i] = i;
+        }
+        node_delete_batch(&pg, &root, 0, n);
+    }
+    if (ok && pg.removed > 0) {
+        tr->count -= pg.removed;
+        if (tr->count == 0) {
+            node_free(tr, tr->root);
+            tr->root = NULL;
+            tr->height = 0;
+            memset(&tr->rect, 0, sizeof(struct rect));
+        } else {
+            while (tr->root->kind == BRANCH && tr->root->count == 1) {
+                struct node *prev = tr->root;
+                tr->root = tr->root->children[0];
+                tr->height--;
+                prev->count = 0;
+                node_free(tr, prev);
+            }
             tr->rect = node_rect_calc(tr->root);
         }
     }
+    if (pg.lists) { tr->free(pg.lists); }
+    if (pg.found) { tr->free(pg.found); }
+    if (pg.entries) { tr->free(pg.entries); }
+    return ok && !pg.oom;
+}
+
+// deletes n items the way rtree_delete finds them, the batch is sorted along a hilbert curve and pushed down
+// the tree in groups, so every node is visited and condensed once. returns false when memory ran out,
+// some of the items may be left in the tree then
+bool rtree_delete_batch(struct rtree *tr, const struct rect *rects, DATATYPE const *items, size_t n) {
+    if (n == 0) { return true; }
+    if (tr->map) { return false; }
+    writer_lock(tr);
+    bool ok = tree_delete_batch(tr, rects, items, n);
+    writer_unlock(tr);
+    return ok;
+}
+
+// body of a packed node, returns its size. the entries of a leaf are reordered points first, refs follows along
+static size_t pack_body(struct node *node, uint64_t *refs, int *points, char *body) {
+    if (node->kind == BRANCH) {
+        struct rect rect = node_rect_calc(node);
+        struct pack_grid grid = pack_grid_new(&rect);
+        uint16_t boxes[MAX_ENTRIES * 2 * DIMS];
+        for (int i = 0; i < node->count; i++) {
+            for (int d = 0; d < DIMS; d++) {
+                boxes[i * 2 * DIMS + d] = pack_floor(&grid, d, node->rects[i].min[d]);
+                boxes[i * 2 * DIMS + DIMS + d] = pack_ceil(&grid, d, node->rects[i].max[d]);
+            }
+        }
+        memcpy(body, &grid, sizeof(grid));
+        memcpy(body + sizeof(grid), boxes, node->count * 2 * DIMS * sizeof(uint16_t));
+        return sizeof(grid) + node->count * 2 * DIMS * sizeof(uint16_t);
+    }
+    uint64_t order[MAX_ENTRIES];
+    int n = 0;
+    for (int i = 0; i < node->count; i++) {
+        if (memcmp(node->rects[i].min, node->rects[i].max, sizeof(NUMTYPE) * DIMS) == 0) {
+            order[n++] = refs[i];
+        }
+    }
+    struct pack_leaf leaf = { .points = n };
+    memcpy(body, &leaf, sizeof(leaf));
+    char *point = body + sizeof(leaf);
+    char *rect = point + n * DIMS * sizeof(NUMTYPE);
+    for (int i = 0; i < node->count; i++) {
+        if (memcmp(node->rects[i].min, node->rects[i].max, sizeof(NUMTYPE) * DIMS) == 0) {
+            memcpy(point, node->rects[i].min, DIMS * sizeof(NUMTYPE));
+            point += DIMS * sizeof(NUMTYPE);
+        } else {
+            memcpy(rect, &node->rects[i], sizeof(struct rect));
+            rect += sizeof(struct rect);
+            order[n++] = refs[i];
+        }
+    }
+    memcpy(refs, order, node->count * sizeof(uint64_t));
+    *points = leaf.points;
+    return rect - body;
+}
+
+// writes the subtree children first and returns the offset the node itself was written at
+static bool flat_write_node(FILE *f, struct node *node, bool packed, uint64_t *off, uint64_t *count, uint64_t *node_off) {
+    uint64_t refs[MAX_ENTRIES];
+    for (int i = 0; i < node->count; i++) {
+        if (node->kind == LEAF) {
+            refs[i] = 0;
+            memcpy(&refs[i], &node->items[i].data, sizeof(DATATYPE));
+        } else if (!flat_write_node(f, node->children[i], packed, off, count, &refs[i])) {
+            return false;
+        }
+    }
+    if (node->kind == LEAF) {
+        *count += node->count;
+    }
+    struct flat_node header = { .kind = node->kind, .count = node->count };
+    char body[sizeof(struct pack_grid) + sizeof(struct pack_leaf) + MAX_ENTRIES * sizeof(struct rect)];
+    size_t len = node->count * sizeof(struct rect);
+    int points = 0;
+    if (packed) {
+        len = pack_body(node, refs, &points, body);
+    } else {
+        memcpy(body, node->rects, len);
+    }
+    size_t pad = flat_refs_offset(node->kind, node->count, points, packed) - sizeof(struct flat_node) - len;
+    uint64_t zero = 0;
+    if (fwrite(&header, sizeof(header), 1, f) != 1 ||
+        fwrite(body, 1, len, f) != len ||
+        fwrite(&zero, 1, pad, f) != pad ||
+        fwrite(refs, sizeof(uint64_t), node->count, f) != (size_t)node->count) {
+        return false;
+    }
+    *node_off = *off;
+    *off += flat_node_size(node->kind, node->count, points, packed);
+    return true;
+}
+
+static bool tree_save(struct rtree *tr, const char *path, bool packed) {
+    if (tr->map || sizeof(DATATYPE) > sizeof(uint64_t)) { return false; }
+    FILE *f = fopen(path, "wb");
+    if (!f) { return false; }
+    int slot;
+    struct node *root = reader_lock(tr, &slot);
+    struct flat_header header = { .version = FLAT_VERSION, .dims = DIMS, .numsize = sizeof(NUMTYPE), .max_entries = MAX_ENTRIES };
+    memcpy(header.magic, packed ? PACK_MAGIC : FLAT_MAGIC, sizeof(header.magic));
+    uint64_t off = sizeof(header);
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    if (ok && root) {
+        ok = flat_write_node(f, root, packed, &off, &header.count, &header.root);
+        header.rect = node_rect_calc(root);
+        for (struct node *node = root; node->kind == BRANCH; node = node->children[0]) {
+            header.height++;
+        }
+    }
+    reader_unlock(tr, slot);
+    ok = ok && fseek(f, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, f) == 1;
+    return fclose(f) == 0 && ok;
+}
+
+// serializes the tree into a pointer-free file that rtree_open_mmap serves without loading it.
+// items are stored by value, so they should be ids rather than pointers into this process
+bool rtree_save(struct rtree *tr, const char *path) {
+    return tree_save(tr, path, false);
+}
+
+// rtree_save in the quantized layout, about half the size for point data. searches may visit a few more
+// branches than on the exact layout but report the same items with their exact coordinates
+bool rtree_save_packed(struct rtree *tr, const char *path) {
+    return tree_save(tr, path, true);
+}
+
+// maps a file written by rtree_save or rtree_save_packed. the tree is read-only: the searches, counts, cursors, rtree_nearby,
+// rtree_search_batch, rtree_stats and rtree_free work on it, the joins and the writers fail. the pages are shared with every other process mapping the same file
+struct rtree *rtree_open_mmap(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) { return NULL; }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct flat_header)) {
+        close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) { return NULL; }
+    const struct flat_header *header = (const struct flat_header *)map;
+    struct rtree *tr = NULL;
+    bool packed = memcmp(header->magic, PACK_MAGIC, sizeof(header->magic)) == 0;
+    if ((packed || memcmp(header->magic, FLAT_MAGIC, sizeof(header->magic)) == 0) && header->version == FLAT_VERSION &&
+        header->dims == DIMS && header->numsize == sizeof(NUMTYPE) && header->max_entries == MAX_ENTRIES &&
+        header->root < (uint64_t)st.st_size) {
+        tr = rtree_new();
+    }
+    if (!tr) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    tr->map = map;
+    tr->map_size = st.st_size;
+    tr->packed = packed;
+    tr->count = header->count;
+    tr->height = (int)header->height;
+    tr->rect = header->rect;
+    return tr;
+}
+
+#define LOAD_CHUNK (8 << 20) // bytes of input per chunk handed to a loader thread
+
+// exact powers of ten, a decimal mantissa below 2^53 scaled by one of them rounds correctly
+static const double pow10_exact[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+// true when the 8 bytes at p are all decimal digits
+static bool digits8(const char *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return ((v & 0xF0F0F0F0F0F0F0F0) | (((v + 0x0606060606060606) & 0xF0F0F0F0F0F0F0F0) >> 4)) == 0x3333333333333333;
+}
+
+// value of 8 digits, combined pairwise within the word instead of one at a time
+static uint64_t parse8(const char *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    v -= 0x3030303030303030;
+    v = v * 10 + (v >> 8);
+    return ((v & 0x000000FF000000FF) * (100 + (1000000ULL << 32)) + ((v >> 16) & 0x000000FF000000FF) * (1 + (10000ULL << 32))) >> 32;
+}
+#else
+static bool digits8(const char *p) { (void)p; return false; }
+static uint64_t parse8(const char *p) { (void)p; return 0; }
+#endif
+
+// accumulates the digits at p into *mant, returns the end of the run. *ndigits counts the digits taken,
+// digits past the 19th still advance p but leave *mant alone
+static const char *parse_digits(const char *p, const char *end, uint64_t *mant, int *ndigits) {
+    while (end - p >= 8 && *ndigits <= 11 && digits8(p)) {
+        *mant = *mant * 100000000 + parse8(p);
+        *ndigits += 8;
+        p += 8;
+    }
+    for (; p < end && *p >= '0' && *p <= '9'; p++) {
+        if (*ndigits < 19) {
+            *mant = *mant * 10 + (uint64_t)(*p - '0');
+        }
+        (*ndigits)++;
+    }
+    return p;
+}
+
+// parses a decimal number, returns its end or NULL. short mantissas with small exponents are converted
+// exactly in place, the rest go to strtod
+static const char *parse_number(const char *p, const char *end, double *out) {
+    const char *start = p;
+    bool neg = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+')) { p++; }
+    uint64_t mant = 0;
+    int ndigits = 0;
+    p = parse_digits(p, end, &mant, &ndigits);
+    int nint = ndigits;
+    int frac = 0;
+    if (p < end && *p == '.') {
+        p = parse_digits(p + 1, end, &mant, &ndigits);
+        frac = ndigits - nint;
+    }
+    if (ndigits == 0) { return NULL; }
+    int exp = 0;
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        const char *e = p + 1;
+        bool eneg = e < end && *e == '-';
+        if (e < end && (*e == '-' || *e == '+')) { e++; }
+        if (e == end || *e < '0' || *e > '9') { return NULL; }
+        for (; e < end && *e >= '0' && *e <= '9'; e++) {
+            exp = exp < 10000 ? exp * 10 + (*e - '0') : exp;
+        }
+        exp = eneg ? -exp : exp;
+        p = e;
+    }
+    exp -= frac;
+    if (ndigits <= 19 && mant <= ((uint64_t)1 << 53) && exp >= -22 && exp <= 22) {
+        double v = (double)mant;
+        v = exp < 0 ? v / pow10_exact[-exp] : v * pow10_exact[exp];
+        *out = neg ? -v : v;
+        return p;
+    }
+    char buf[128]; // the input is not terminated, strtod gets a copy
+    if (p - start >= (ptrdiff_t)sizeof(buf)) { return NULL; }
+    memcpy(buf, start, p - start);
+    buf[p - start] = '\0';
+    *out = strtod(buf, NULL);
+    return p;
+}
+
+// parses a non-negative integer, returns its end or NULL
+static const char *parse_id(const char *p, const char *end, uint64_t *out) {
+    uint64_t id = 0;
+    int ndigits = 0;
+    p = parse_digits(p, end, &id, &ndigits);
+    if (ndigits == 0 || ndigits > 19) { return NULL; }
+    *out = id;
+    return p;
+}
+
+static const char *skip_blanks(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t')) { p++; }
+    return p;
+}
+
+// entries parsed from one chunk of the input
+struct load_chunk {
+    struct bulk_entry *entries;
+    size_t n;
+    size_t cap;
+};
+
+struct load {
+    struct rtree *tr;
+    const char *data;
+    size_t size;
+    enum rtree_file_format format;
+    size_t chunk;               // bytes per chunk, whole records for the binary format
+    size_t nchunks;
+    struct load_chunk *chunks;
+    size_t next;                // next chunk to be taken by a worker
+    bool failed;
+};
+
+static struct bulk_entry *load_entry(struct load *l, struct load_chunk *c) {
+    if (c->n == c->cap) {
+        size_t cap = c->cap * 2;
+        struct bulk_entry *entries = (struct bulk_entry *)l->tr->malloc(cap * sizeof(struct bulk_entry));
+        if (!entries) { return NULL; }
+        memcpy(entries, c->entries, c->n * sizeof(struct bulk_entry));
+        l->tr->free(c->entries);
+        c->entries = entries;
+        c->cap = cap;
+    }
+    return &c->entries[c->n++];
+}
+
+// parses the lines starting in [start, end) of the csv input, the last one may run past end
+static bool load_csv(struct load *l, struct load_chunk *c, size_t start, size_t end) {
+    const char *p = l->data + start, *stop = l->data + end, *eof = l->data + l->size;
+    if (start > 0 && p[-1] != '\n') { // the line cut by the chunk boundary belongs to the previous chunk
+        p = memchr(p, '\n', eof - p);
+        p = p ? p + 1 : eof;
+    }
+    while (p < stop) {
+        const char *line = p, *nl = memchr(p, '\n', eof - p);
+        const char *eol = nl ? nl : eof;
+        p = nl ? nl + 1 : eof;
+        const char *q = skip_blanks(line, eol);
+        if (q == eol || *q == '\r') { continue; }
+        struct rect rect;
+        uint64_t id;
+        for (int d = 0; d < DIMS && q; d++) {
+            double v;
+            q = parse_number(skip_blanks(q, eol), eol, &v);
+            if (q) {
+                rect.min[d] = rect.max[d] = (NUMTYPE)v;
+                q = skip_blanks(q, eol);
+                q = q < eol && *q == ',' ? q + 1 : NULL;
+            }
+        }
+        q = q ? parse_id(skip_blanks(q, eol), eol, &id) : NULL;
+        if (q) {
+            q = skip_blanks(q, eol);
+            q = q == eol || *q == ',' || *q == '\r' ? q : NULL; // further columns are ignored
+        }
+        if (!q) {
+            if (line == l->data) { continue; } // a header line
+            return false;
+        }
+        struct bulk_entry *entry = load_entry(l, c);
+        if (!entry) { return false; }
+        entry->rect = rect;
+        entry->item.data = (DATATYPE)(uintptr_t)id;
+    }
+    return true;
+}
+
+// converts the binary records in [start, end)
+static bool load_binary(struct load *l, struct load_chunk *c, size_t start, size_t end) {
+    for (size_t off = start; off < end; off += sizeof(struct rtree_point_record)) {
+        struct rtree_point_record rec;
+        memcpy(&rec, l->data + off, sizeof(rec));
+        struct bulk_entry *entry = load_entry(l, c);
+        if (!entry) { return false; }
+        for (int d = 0; d < DIMS; d++) {
+            entry->rect.min[d] = entry->rect.max[d] = (NUMTYPE)rec.coords[d];
+        }
+        entry->item.data = (DATATYPE)(uintptr_t)rec.id;
+    }
+    return true;
+}
+
+// takes chunks until none are left, every chunk fills its own array so workers only share the chunk counter
+static void *load_worker(void *arg) {
+    struct load *l = (struct load *)arg;
+    for (;;) {
+        size_t i = __atomic_fetch_add(&l->next, 1, __ATOMIC_RELAXED);
+        if (i >= l->nchunks || __atomic_load_n(&l->failed, __ATOMIC_RELAXED)) {
+            return NULL;
+        }
+        struct load_chunk *c = &l->chunks[i];
+        size_t start = i * l->chunk, end = MIN(start + l->chunk, l->size);
+        // about one entry per 24 bytes of csv, the array doubles when the lines are shorter
+        c->cap = l->format == RTREE_FILE_BINARY ? (end - start) / sizeof(struct rtree_point_record) + 1 : (end - start) / 24 + 16;
+        c->entries = (struct bulk_entry *)l->tr->malloc(c->cap * sizeof(struct bulk_entry));
+        bool ok = c->entries && (l->format == RTREE_FILE_BINARY ? load_binary(l, c, start, end) : load_csv(l, c, start, end));
+        if (!ok) {
+            __atomic_store_n(&l->failed, true, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// parses the input on up to nthreads threads into one array in file order, *entries stays NULL when the input
+// holds no points
+static bool load_parse(struct load *l, int nthreads, struct bulk_entry **entries, size_t *n) {
+    struct rtree *tr = l->tr;
+    l->nchunks = (l->size + l->chunk - 1) / l->chunk;
+    l->chunks = (struct load_chunk *)tr->malloc(l->nchunks * sizeof(struct load_chunk));
+    if (!l->chunks) { return false; }
+    memset(l->chunks, 0, l->nchunks * sizeof(struct load_chunk));
+    workers_run(&tr->workers, tr->malloc, tr->free, (int)MIN((size_t)MAX(nthreads, 1), l->nchunks), load_worker, l);
+    *n = 0;
+    for (size_t i = 0; i < l->nchunks; i++) {
+        *n += l->chunks[i].n;
+    }
+    *entries = !l->failed && *n > 0 ? (struct bulk_entry *)tr->malloc(*n * sizeof(struct bulk_entry)) : NULL;
+    bool ok = !l->failed && (*n == 0 || *entries);
+    for (size_t i = 0, at = 0; i < l->nchunks; i++) {
+        if (*entries) {
+            memcpy(&(*entries)[at], l->chunks[i].entries, l->chunks[i].n * sizeof(struct bulk_entry));
+            at += l->chunks[i].n;
+        }
+        if (l->chunks[i].entries) { tr->free(l->chunks[i].entries); }
+    }
+    tr->free(l->chunks);
+    return ok;
+}
+
+// loads the points of a file into the tree, see enum rtree_file_format. the file is mapped and cut into chunks
+// that up to nthreads threads parse at once, the points of all chunks then go to the bulk loader together. an
+// already populated tree gets them as one rtree_insert_batch. returns false when the file cannot be read, holds
+// a malformed record or memory runs out, the tree is left as it was then
+bool rtree_load_file(struct rtree *tr, const char *path, enum rtree_file_format format, int nthreads) {
+    if (tr->map) { return false; }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) { return false; }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    size_t size = (size_t)st.st_size;
+    if (size == 0 || (format == RTREE_FILE_BINARY && size % sizeof(struct rtree_point_record) != 0)) {
+        close(fd);
+        return size == 0;
+    }
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) { return false; }
+    madvise(map, size, MADV_SEQUENTIAL);
+    struct load l = { .tr = tr, .data = (const char *)map, .size = size, .format = format, .chunk = LOAD_CHUNK };
+    if (format == RTREE_FILE_BINARY) {
+        l.chunk -= l.chunk % sizeof(struct rtree_point_record);
+    }
+    struct bulk_entry *entries = NULL;
+    size_t n = 0;
+    bool ok = load_parse(&l, nthreads, &entries, &n);
+    munmap(map, size);
+    if (!entries) { return ok; }
+    writer_lock(tr); // parsing runs outside the lock, readers only wait for the build
+    ok = tree_insert_entries(tr, entries, n);
+    writer_unlock(tr);
+    return ok;
+}
+
+#define SHARD_KEY_MAX (HILBERT_BITS * DIMS == 64 ? UINT64_MAX : (UINT64_C(1) << (HILBERT_BITS * DIMS)) - 1)
+
+// a shard tree with the settings of the index
+static struct rtree *shard_new(struct rtree_shards *s) {
+    struct rtree *tr = rtree_new();
+    if (tr && s->concurrent) {
+        rtree_set_concurrent(tr, true);
+    }
+    return tr;
+}
+
+// shard whose key range holds the rect center
+static int shard_of(struct rtree_shards *s, const struct rect *rect) {
+    uint64_t key = hilbert_key(&s->frame, rect, HILBERT_BITS);
+    int lo = 0, hi = s->n - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (s->bounds[mid] < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+void rtree_shards_free(struct rtree_shards *s) {
+    for (int i = 0; i < s->n && s->trees; i++) {
+        if (s->trees[i]) { rtree_free(s->trees[i]); }
+    }
+    free(s->trees);
+    free(s->bounds);
+    workers_free(s->workers, free);
+    free(s);
+}
+
+// an index of n trees, each holding the items whose rect centers fall into its range of the hilbert curve through
+// the frame from min to max. neighbouring items share a shard, so a window only reaches the few shards whose rects
+// it intersects. centers outside the frame are clamped onto its border. the ranges start out even and follow the
+// data once rtree_shards_rebalance is called
+struct rtree_shards *rtree_shards_new(int n, const NUMTYPE *min, const NUMTYPE *max) {
+    if (n < 1) { return NULL; }
+    struct rtree_shards *s = (struct rtree_shards *)malloc(sizeof(struct rtree_shards));
+    if (!s) { return NULL; }
+    memset(s, 0, sizeof(struct rtree_shards));
+    s->n = n;
+    memcpy(&s->frame.min[0], min, sizeof(NUMTYPE) * DIMS);
+    memcpy(&s->frame.max[0], max ? max : min, sizeof(NUMTYPE) * DIMS);
+    s->trees = (struct rtree **)calloc(n, sizeof(struct rtree *));
+    s->bounds = (uint64_t *)malloc(n * sizeof(uint64_t));
+    if (!s->trees || !s->bounds) {
+        rtree_shards_free(s);
+        return NULL;
+    }
+    for (int i = 0; i < n; i++) {
+        s->bounds[i] = i == n - 1 ? SHARD_KEY_MAX : SHARD_KEY_MAX / n * (i + 1);
+        if (!(s->trees[i] = shard_new(s))) {
+            rtree_shards_free(s);
+            return NULL;
+        }
+    }
+    return s;
+}
+
+// puts every shard in concurrent mode, see rtree_set_concurrent. inserts and deletes from several threads
+// then run in parallel as long as they go to different shards. must be called while no other thread uses the index
+void rtree_shards_set_concurrent(struct rtree_shards *s, bool concurrent) {
+    s->concurrent = concurrent;
+    for (int i = 0; i < s->n; i++) {
+        rtree_set_concurrent(s->trees[i], concurrent);
+    }
+}
+
+bool rtree_shards_insert(struct rtree_shards *s, const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data) {
+    struct rect rect;
+    memcpy(&rect.min[0], min, sizeof(NUMTYPE) * DIMS);
+    memcpy(&rect.max[0], max ? max : min, sizeof(NUMTYPE) * DIMS);
+    return rtree_insert(s->trees[shard_of(s, &rect)], rect.min, rect.max, data);
+}
+
+// the rect leads to the shard the item was inserted into, the ranges only move along with the items
+bool rtree_shards_delete(struct rtree_shards *s, const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data) {
+    struct rect rect;
+    memcpy(&rect.min[0], min, sizeof(NUMTYPE) * DIMS);
+    memcpy(&rect.max[0], max ? max : min, sizeof(NUMTYPE) * DIMS);
+    return rtree_delete(s->trees[shard_of(s, &rect)], rect.min, rect.max, data);
+}
+
+// asks only the shards whose rect the window intersects, in curve order. in concurrent mode the rects may be
+// changing and every shard checks its root instead
+void rtree_shards_search(struct rtree_shards *s, const NUMTYPE *min, const NUMTYPE *max, bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data, void *udata), void *udata) {
+    struct rect rect;
+    memcpy(&rect.min[0], min, sizeof(NUMTYPE) * DIMS);
+    memcpy(&rect.max[0], max ? max : min, sizeof(NUMTYPE) * DIMS);
+    for (int i = 0; i < s->n; i++) {
+        struct rtree *tr = s->trees[i];
+        if (!s->concurrent && (tr->count == 0 || !rect_intersects(&tr->rect, &rect))) {
+            continue;
+        }
+        if (!tree_search(tr, &rect, RTREE_INTERSECTS, iter, udata)) {
+            return;
+        }
+    }
+}
+
+size_t rtree_shards_count(struct rtree_shards *s) {
+    size_t count = 0;
+    for (int i = 0; i < s->n; i++) {
+        count += rtree_count(s->trees[i]);
+    }
+    return count;
+}
+
+// a batch grouped by shard, workers take whole shards
+struct shards_batch {
+    struct rtree_shards *s;
+    struct rect *rects;
+    DATATYPE *items;
+    size_t *offs;           // start of the group of every shard, n + 1 of them
+    int next;               // next shard to be taken by a worker
+    bool failed;
+};
+
+static void *shards_worker(void *arg) {
+    struct shards_batch *b = (struct shards_batch *)arg;
+    for (;;) {
+        int i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED);
+        if (i >= b->s->n) {
+            return NULL;
+        }
+        size_t off = b->offs[i], len = b->offs[i + 1] - off;
+        if (len > 0 && !rtree_insert_batch(b->s->trees[i], &b->rects[off], &b->items[off], len)) {
+            __atomic_store_n(&b->failed, true, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// groups the batch by shard and inserts the groups with rtree_insert_batch on up to nthreads threads, one shard
+// per thread at a time. the threads stay with the index until rtree_shards_free. returns false when out of memory, a shard that ran out keeps none of its group
+bool rtree_shards_insert_batch(struct rtree_shards *s, const struct rect *rects, DATATYPE const *items, size_t n, int nthreads) {
+    if (n == 0) { return true; }
+    struct shards_batch b = { .s = s };
+    int *shard = (int *)malloc(n * sizeof(int));
+    b.rects = (struct rect *)malloc(n * sizeof(struct rect));
+    b.items = (DATATYPE *)malloc(n * sizeof(DATATYPE));
+    b.offs = (size_t *)calloc((size_t)s->n + 1, sizeof(size_t));
+    bool ok = shard && b.rects && b.items && b.offs;
+    if (ok) {
+        for (size_t i = 0; i < n; i++) {
+            shard[i] = shard_of(s, &rects[i]);
+            b.offs[shard[i] + 1]++;
+        }
+        for (int i = 0; i < s->n; i++) {
+            b.offs[i + 1] += b.offs[i];
+        }
+        for (size_t i = 0; i < n; i++) { // the offsets end up at the group ends and are moved back after
+            size_t at = b.offs[shard[i]]++;
+            b.rects[at] = rects[i];
+            b.items[at] = items[i];
+        }
+        memmove(&b.offs[1], &b.offs[0], s->n * sizeof(size_t));
+        b.offs[0] = 0;
+        workers_run(&s->workers, malloc, free, MIN(nthreads, s->n), shards_worker, &b);
+        ok = !b.failed;
+    }
+    free(b.offs);
+    free(b.items);
+    free(b.rects);
+    free(shard);
+    return ok;
+}
+
+// moves the range boundaries to the quantiles of the items, so that every shard ends up with an even share, and
+// rebuilds the shards with the bulk loader. meant for when inserts have piled up in a few shards, the new shards
+// are built before the old ones are released, nothing changes when memory runs out. must be called while no other
+// thread uses the index
+bool rtree_shards_rebalance(struct rtree_shards *s) {
+    size_t total = rtree_shards_count(s), n = 0;
+    struct bulk_entry *entries = (struct bulk_entry *)malloc(MAX(total, 1) * sizeof(struct bulk_entry));
+    struct bulk_entry *tmp = (struct bulk_entry *)malloc(MAX(total, 1) * sizeof(struct bulk_entry));
+    uint64_t *bounds = (uint64_t *)malloc((size_t)s->n * sizeof(uint64_t));
+    struct rtree **trees = (struct rtree **)malloc((size_t)s->n * sizeof(struct rtree *));
+    bool ok = entries && tmp && bounds && trees;
+    if (trees) { memset(trees, 0, (size_t)s->n * sizeof(struct rtree *)); }
+    for (int i = 0; ok && i < s->n; i++) {
+        if (s->trees[i]->root) {
+            n = node_collect(s->trees[i]->root, entries, n);
+        }
+    }
+    ok = ok && (n == 0 || hilbert_sort_in(s->trees[0], &s->frame, HILBERT_BITS, entries, tmp, n));
+    size_t start = 0;
+    for (int i = 0; ok && i < s->n; i++) {
+        size_t cut = MAX(n * (i + 1) / s->n, 1); // a shard ends after the last item with its key
+        bounds[i] = i == s->n - 1 || n == 0 ? SHARD_KEY_MAX : MAX(entries[cut - 1].key, i > 0 ? bounds[i - 1] : 0);
+        size_t end = start;
+        while (end < n && entries[end].key <= bounds[i]) {
+            end++;
+        }
+        struct bulk_entry *part = end > start ? (struct bulk_entry *)malloc((end - start) * sizeof(struct bulk_entry)) : NULL;
+        ok = (trees[i] = shard_new(s)) != NULL && (end == start || part != NULL);
+        if (ok && part) { // the bulk loader takes the entries over
+            memcpy(part, &entries[start], (end - start) * sizeof(struct bulk_entry));
+            ok = bulk_build(trees[i], part, end - start);
+            rtree_set_concurrent(trees[i], s->concurrent); // publishes the new root
+        } else if (part) {
+            free(part);
+        }
+        start = end;
+    }
+    for (int i = 0; i < s->n && trees; i++) { // the old shards go on success, the new ones on failure
+        struct rtree *old = ok ? s->trees[i] : trees[i];
+        if (ok) { s->trees[i] = trees[i]; }
+        if (old) { rtree_free(old); }
+    }
+    if (ok) {
+        memcpy(s->bounds, bounds, s->n * sizeof(uint64_t));
+    }
+    free(trees);
+    free(bounds);
+    free(tmp);
+    free(entries);
+    return ok;
 }
\ No newline at end of file
@@ -2,13 +2,24 @@
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
 
 #define DATATYPE void * 
+#ifndef NUMTYPE
 #define NUMTYPE double
+#endif
+#ifndef DIMS
 #define DIMS 2
-#define MAX_ENTRIES 64
+#endif
+// a node takes 32 bytes plus 2 * DIMS * sizeof(NUMTYPE) + sizeof(DATATYPE) per entry, rounded up to whole cache
+// lines. nodes never straddle a page when that size divides 4096, with 2-d doubles a fanout of 12, 24 or 50 fills
+// the page. the default of 64 takes 41 lines and measured as fast as 50 since searches prefetch whole nodes
+#ifndef MAX_ENTRIES
+#define MAX_ENTRIES 64 // may be overridden at build time, see the bench target
+#endif
 #define MIN_ENTRIES_PERCENTAGE 10
-#define FAST_CHOOSER 2  // 0 - off , 1 - fast, 2 - faster
+#define FAST_CHOOSER 2  // default chooser, 0 - off , 1 - fast, 2 - faster
 #define panic(_msg_) { \
     fprintf(stderr, "panic: %s (%s:%d)\n", (_msg_), __FILE__, __LINE__); \
     exit(1); \
@@ -22,6 +33,26 @@ enum kind {
     BRANCH = 2,
 };
 
+enum rtree_split {
+    RTREE_SPLIT_EDGE_SNAP = 0,  // entries go to the closer edge of the largest axis
+    RTREE_SPLIT_QUADRATIC = 1,  // guttman's quadratic split
+    RTREE_SPLIT_RSTAR = 2,      // r*-tree margin and overlap minimizing split
+};
+
+enum rtree_chooser {
+    RTREE_CHOOSE_LEAST_ENLARGEMENT = 0,     // FAST_CHOOSER 0
+    RTREE_CHOOSE_SMALLEST_CONTAINING = 1,   // FAST_CHOOSER 1
+    RTREE_CHOOSE_FIRST_CONTAINING = 2,      // FAST_CHOOSER 2
+    RTREE_CHOOSE_LEAST_OVERLAP = 3,         // r*-tree, least overlap enlargement above the leaves
+};
+
+// what rtree_search_ex matches item rects against the window with
+enum rtree_predicate {
+    RTREE_INTERSECTS = 0,   // the rect shares a point with the window, as rtree_search
+    RTREE_WITHIN = 1,       // the rect lies inside the window
+    RTREE_CONTAINS = 2,     // the rect covers the window
+};
+
 struct rect {
     NUMTYPE min[DIMS];
     NUMTYPE max[DIMS];
@@ -34,8 +65,59 @@ struct item {
 struct node {
     enum kind kind;     // LEAF or BRANCH
     int count;          // number of rects
+    int rc;             // number of references to the node, shared nodes are released by the last owner
+    uint64_t gen;       // writer generation that created the node, see rtree_set_concurrent
+    size_t total;       // items in the subtree of a branch, a leaf holds count items
     struct rect rects[MAX_ENTRIES];
     union { struct node *children[MAX_ENTRIES]; struct item items[MAX_ENTRIES]; };
+    uint64_t keys[MAX_ENTRIES]; // hilbert keys, the largest of the subtree for branches. only allocated in hilbert mode
+};
+
+// slab allocator for nodes, released nodes are kept on a free list until the tree is freed.
+// clones share the pool of the tree they were made from
+struct node_pool {
+    void *slabs;        // slabs in allocation order, newest first
+    void *free;         // released nodes, linked through their first word
+    size_t slab_nodes;  // nodes in the newest slab, doubles with every slab
+    size_t bytes;       // memory held by all slabs
+    size_t node_size;   // bytes per node, nodes of hilbert trees carry their keys
+    size_t refs;        // trees using the pool
+    pthread_mutex_t lock; // taken while more than one tree uses the pool
+};
+
+// nodes replaced by a writer that readers may still be walking
+struct node_list {
+    struct node **nodes;
+    size_t len;
+    size_t cap;
+};
+
+// threads kept for the parallel calls, started by the first call that asks for them and stopped when the tree is
+// freed. they sleep between calls, a call hands them its work function and runs it on its own thread as well
+struct worker_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;        // a call posted its work or the pool is stopping
+    pthread_cond_t done;        // the last thread left the work of the call
+    pthread_t *threads;
+    int count;
+    int cap;
+    bool busy;                  // a call has the pool, calls made meanwhile run on their own thread alone
+    void *(*work)(void *);
+    void *arg;
+    uint64_t call;              // calls so far, a thread takes part in each call once
+    int wanted;                 // threads the current call still takes
+    int working;                // threads inside the work of the current call
+    bool stop;
+};
+
+// work done by the tree operations, only counted when built with -DRTREE_STATS
+struct rtree_counters {
+    uint64_t nodes_visited;
+    uint64_t rect_tests;    // entry rects compared against a query or an inserted rect
+    uint64_t leaf_hits;     // items handed to search callbacks
+    uint64_t splits;
+    uint64_t memmove_bytes; // entries shifted inside nodes on insert and delete
+    uint64_t allocs;        // nodes taken from the pool, including copies made in concurrent mode
 };
 
 struct rtree {
@@ -45,11 +127,148 @@ struct rtree {
     struct node *root; 
     void *(*malloc)(size_t);
     void (*free)(void *);
+    struct node_pool *pool;
+    enum rtree_split split;     // node split algorithm, see rtree_set_split
+    enum rtree_chooser chooser; // subtree choice on insert
+    bool reinsert;              // r*-tree forced reinsertion of leaf entries on overflow
+    bool hilbert;               // entries are ordered by hilbert key instead of min[0], see rtree_set_hilbert
+    struct rect frame;          // space the hilbert keys are computed in
+    bool reinserting;           // forced reinsertion already happened during the current insert
+    struct node *pending;       // leaf entries waiting to be reinserted
+    bool concurrent;            // searches run against published snapshots while a writer copies the paths it changes
+    uint64_t gen;               // current writer generation, nodes of older generations are immutable
+    struct node *shared;        // root published to readers
+    pthread_mutex_t lock;       // serializes writers in concurrent mode
+    unsigned epoch;             // readers register in the slot of the epoch they started in
+    size_t readers[2];
+    bool draining;              // waiting for the readers of the previous epoch to leave
+    struct node_list limbo[2];  // retired nodes per epoch slot
+    struct node_list reserve;   // nodes set aside by a batch insert, taken before the pool
+    struct worker_pool *workers; // threads of rtree_search_batch, rtree_join_parallel and rtree_load_file
+    const void *map;            // file mapped by rtree_open_mmap, the tree is read-only when set
+    size_t map_size;
+    bool packed;                // the map is in the quantized layout of rtree_save_packed
+    struct rtree_counters counters;
+};
+
+// window query of a search batch, hits are collected into the caller's results buffer
+struct rtree_query {
+    NUMTYPE min[DIMS];
+    NUMTYPE max[DIMS];
+    DATATYPE *results;  // may be NULL when the callback consumes the hits
+    size_t cap;         // capacity of results
+    size_t count;       // hits found, larger than cap when results was too small
+};
+
+#define RTREE_CURSOR_DEPTH 64
+#define RTREE_MASK_WORDS ((MAX_ENTRIES + 63) / 64)
+
+// one bit per entry of a node, nodes of more than 64 entries take several words
+struct rtree_mask {
+    uint64_t words[RTREE_MASK_WORDS];
+};
+
+struct rtree_cursor_frame {
+    const void *node;
+    struct rtree_mask mask; // entries of the node still to be visited
+};
+
+// pull-style window query, see rtree_cursor_open
+struct rtree_cursor {
+    struct rtree *tr;
+    struct rect rect;
+    int slot;           // reader slot pinned while open
+    int depth;          // top of the stack, -1 when exhausted
+    struct rtree_cursor_frame stack[RTREE_CURSOR_DEPTH];
+};
+
+#define RTREE_STATS_LEVELS 16 // levels broken down by rtree_stats, deeper ones only add to the totals
+
+struct rtree_level_stats {
+    size_t nodes;
+    size_t entries;
+    double fill;        // entries per node slot
+    double overlap;     // area shared by entries of the same node
+    double dead_space;  // node area covered by none of its entries, estimated as in rtree_stats
+};
+
+// tree quality snapshot taken by rtree_stats, level 0 is the root
+struct rtree_stats {
+    size_t count;
+    int height;
+    size_t nodes;
+    double fill;
+    double overlap;
+    double dead_space;
+    size_t memory;      // bytes held by the tree, including released nodes kept by the pool and nodes shared with clones
+    struct rtree_level_stats levels[RTREE_STATS_LEVELS];
+    struct rtree_counters counters;
+};
+
+// input formats of rtree_load_file. csv lines hold DIMS coordinates followed by an integer id, separated by commas,
+// a first line that does not parse is taken for a header. binary files are a plain array of rtree_point_record
+enum rtree_file_format {
+    RTREE_FILE_CSV = 0,
+    RTREE_FILE_BINARY = 1,
+};
+
+// record of the binary format in host byte order, the id becomes the item of the point
+struct rtree_point_record {
+    double coords[DIMS];
+    uint64_t id;
+};
+
+// index of several trees partitioned by ranges of a hilbert curve, see rtree_shards_new
+struct rtree_shards {
+    int n;
+    struct rtree **trees;
+    uint64_t *bounds;       // largest hilbert key of the range of every shard, ranges follow each other
+    struct rect frame;      // space the hilbert curve runs through
+    bool concurrent;        // the shards are in concurrent mode
+    struct worker_pool *workers; // threads of rtree_shards_insert_batch
 };
 
 struct rtree *rtree_new();
-bool rtree_insert(struct rtree *tr, const double *min, const double *max, const void *data);
+struct rtree *rtree_new_with_allocator(void *(*cust_malloc)(size_t), void (*cust_free)(void*));
+bool rtree_insert(struct rtree *tr, const NUMTYPE *min, const NUMTYPE *max, const void *data);
 void rtree_free(struct rtree *tr);
-void rtree_search(struct rtree *tr, const double *min, const double *max, bool (*iter)(const double *min, const double *max, const void *data, void *udata), void *udata);
+void rtree_search(struct rtree *tr, const NUMTYPE *min, const NUMTYPE *max, bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const void *data, void *udata), void *udata);
+void rtree_search_ex(struct rtree *tr, const NUMTYPE *min, const NUMTYPE *max, enum rtree_predicate pred, bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const void *data, void *udata), void *udata);
 size_t rtree_count(struct rtree *tr);
-void rtree_delete(struct rtree *tr, const double *min, const double *max, const void *data);
\ No newline at end of file
+size_t rtree_count_in(struct rtree *tr, const NUMTYPE *min, const NUMTYPE *max);
+bool rtree_delete(struct rtree *tr, const NUMTYPE *min, const NUMTYPE *max, const void *data);
+bool rtree_update(struct rtree *tr, const NUMTYPE *old_min, const NUMTYPE *old_max, const NUMTYPE *new_min, const NUMTYPE *new_max, const void *data);
+bool rtree_bulk_load(struct rtree *tr, const struct rect *rects, DATATYPE const *items, size_t n);
+// rtree_insert_batch beats inserting one by one from about a hundredth of the tree on, and at any size in concurrent
+// mode and on cloned trees, where every node it updates would be copied once per insert otherwise
+bool rtree_insert_batch(struct rtree *tr, const struct rect *rects, DATATYPE const *items, size_t n);
+bool rtree_delete_batch(struct rtree *tr, const struct rect *rects, DATATYPE const *items, size_t n);
+bool rtree_compact(struct rtree *tr);
+struct rtree *rtree_clone(struct rtree *tr);
+void rtree_stats(struct rtree *tr, struct rtree_stats *stats);
+bool rtree_search_batch(struct rtree *tr, struct rtree_query *queries, size_t n, bool (*iter)(size_t query, const NUMTYPE *min, const NUMTYPE *max, const void *data, void *udata), void *udata, int nthreads);
+bool rtree_join(struct rtree *a, struct rtree *b, bool (*iter)(const NUMTYPE *amin, const NUMTYPE *amax, const void *adata, const NUMTYPE *bmin, const NUMTYPE *bmax, const void *bdata, void *udata), void *udata);
+bool rtree_join_parallel(struct rtree *a, struct rtree *b, bool (*iter)(const NUMTYPE *amin, const NUMTYPE *amax, const void *adata, const NUMTYPE *bmin, const NUMTYPE *bmax, const void *bdata, void *udata), void *udata, int nthreads);
+bool rtree_cursor_open(struct rtree_cursor *cur, struct rtree *tr, const NUMTYPE *min, const NUMTYPE *max);
+bool rtree_cursor_next(struct rtree_cursor *cur, const NUMTYPE **min, const NUMTYPE **max, void **data);
+void rtree_cursor_close(struct rtree_cursor *cur);
+void rtree_set_concurrent(struct rtree *tr, bool concurrent);
+void rtree_set_split(struct rtree *tr, enum rtree_split split);
+bool rtree_set_hilbert(struct rtree *tr, const NUMTYPE *min, const NUMTYPE *max);
+// rtree_nearby orders by the squared euclidean distance and passes it to iter squared, take its sqrt for the
+// distance itself. rtree_nearby_with_dist passes on whatever dist returns
+bool rtree_nearby(struct rtree *tr, const NUMTYPE *point, size_t k, bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const void *data, double dist, void *udata), void *udata);
+bool rtree_nearby_with_dist(struct rtree *tr, const NUMTYPE *point, size_t k, double (*dist)(const NUMTYPE *min, const NUMTYPE *max, const NUMTYPE *point, void *udata), bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const void *data, double dist, void *udata), void *udata);
+bool rtree_save(struct rtree *tr, const char *path);
+bool rtree_save_packed(struct rtree *tr, const char *path);
+struct rtree *rtree_open_mmap(const char *path);
+bool rtree_load_file(struct rtree *tr, const char *path, enum rtree_file_format format, int nthreads);
+struct rtree_shards *rtree_shards_new(int n, const NUMTYPE *min, const NUMTYPE *max);
+void rtree_shards_free(struct rtree_shards *s);
+void rtree_shards_set_concurrent(struct rtree_shards *s, bool concurrent);
+bool rtree_shards_insert(struct rtree_shards *s, const NUMTYPE *min, const NUMTYPE *max, const void *data);
+bool rtree_shards_delete(struct rtree_shards *s, const NUMTYPE *min, const NUMTYPE *max, const void *data);
+bool rtree_shards_insert_batch(struct rtree_shards *s, const struct rect *rects, DATATYPE const *items, size_t n, int nthreads);
+void rtree_shards_search(struct rtree_shards *s, const NUMTYPE *min, const NUMTYPE *max, bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const void *data, void *udata), void *udata);
+size_t rtree_shards_count(struct rtree_shards *s);
+bool rtree_shards_rebalance(struct rtree_shards *s);
\ No newline at end of file
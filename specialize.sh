@@ -0,0 +1,27 @@
+#!/bin/sh
+# generates NAME.h and NAME.c from rtree.h and rtree.c with their own dimensions, coordinate type
+# and fanout, public names are prefixed with NAME so that several specializations link into one binary
+#
+# usage: ./specialize.sh NAME DIMS NUMTYPE MAX_ENTRIES, e.g. ./specialize.sh rtree3d_f32 3 float 32
+set -e
+if [ $# -ne 4 ]; then
+    echo "usage: $0 NAME DIMS NUMTYPE MAX_ENTRIES" >&2
+    exit 1
+fi
+name=$1
+upper=$(echo "$name" | tr a-z A-Z)
+dir=$(dirname "$0")
+prog="
+s/\brtree_/${name}_/g
+s/\bstruct rtree\b/struct ${name}/g
+s/\b(struct|enum) (rect|item|node|node_pool|node_list|kind)\b/\1 ${name}_\2/g
+s/\bRTREE_/${upper}_/g
+s/\b(DIMS|NUMTYPE|DATATYPE|MAX_ENTRIES|MIN_ENTRIES|MIN_ENTRIES_PERCENTAGE|FAST_CHOOSER|LEAF|BRANCH)\b/${upper}_\1/g
+s/^#define ${upper}_DIMS .*/#define ${upper}_DIMS $2/
+s/^#define ${upper}_NUMTYPE .*/#define ${upper}_NUMTYPE $3/
+s/^#define ${upper}_MAX_ENTRIES .*/#define ${upper}_MAX_ENTRIES $4/
+s/\"rtree\.h\"/\"${name}.h\"/
+"
+for ext in h c; do
+    { echo "// generated by specialize.sh from rtree.$ext, do not edit"; sed -E "$prog" "$dir/rtree.$ext"; } > "$name.$ext"
+done
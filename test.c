@@ -0,0 +1,777 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "rtree.h"
+
+// usage: test [concurrent]
+//
+// checks every tree operation against a brute-force scan of the items the tree should hold. make test runs it
+// at several fanouts and in three dimensions, then runs the concurrent mode test alone under the thread sanitizer
+
+#define expect(_cond_) { \
+    if (!(_cond_)) { \
+        fprintf(stderr, "failed: %s (%s:%d)\n", #_cond_, __FILE__, __LINE__); \
+        exit(1); \
+    } \
+}
+
+#define N 4000          // items of a model, item i is the pointer i + 1
+#define QUERIES 100     // windows per check
+#define READERS 4       // search threads of the concurrent mode test
+#define NEARBY_K 25
+#define SPACE 100       // coordinates lie in [0, SPACE)
+
+// what a tree should hold, item i has rects[i] while alive[i] is set
+struct model {
+    struct rect rects[N];
+    bool alive[N];
+};
+
+static uint64_t seed = 88172645463325252ULL;
+static struct rect rects[N];    // rects the items are inserted with
+static struct rect moved[N];    // rects rtree_update moves them to
+static struct model model, other;
+
+double rnd() {
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return (seed >> 11) * (1.0 / 9007199254740992.0);
+}
+
+void *item_of(int i) {
+    return (void *)(uintptr_t)(i + 1);
+}
+
+int index_of(const void *data) {
+    return (int)((uintptr_t)data - 1);
+}
+
+// a third points, the rest boxes up to 5 wide, and every seventh stacked on the center so that nodes overlap
+void gen_rect(struct rect *rect, int i) {
+    for (int d = 0; d < DIMS; d++) {
+        double lo = i % 7 == 0 ? SPACE / 2 + rnd() : rnd() * (SPACE - 5);
+        rect->min[d] = (NUMTYPE)lo;
+        rect->max[d] = (NUMTYPE)(i % 3 == 0 ? lo : lo + rnd() * 5);
+    }
+}
+
+// windows of three sizes, some reaching past the space
+void gen_window(struct rect *w, int q) {
+    double size = q % 3 == 0 ? 60 : q % 3 == 1 ? 10 : 1;
+    for (int d = 0; d < DIMS; d++) {
+        w->min[d] = (NUMTYPE)(rnd() * SPACE - 5);
+        w->max[d] = (NUMTYPE)(w->min[d] + rnd() * size);
+    }
+}
+
+void full_window(struct rect *w) {
+    for (int d = 0; d < DIMS; d++) {
+        w->min[d] = -1;
+        w->max[d] = SPACE + 1;
+    }
+}
+
+bool intersects(const struct rect *a, const struct rect *b) {
+    for (int d = 0; d < DIMS; d++) {
+        if (a->min[d] > b->max[d] || a->max[d] < b->min[d]) { return false; }
+    }
+    return true;
+}
+
+bool contains(const struct rect *a, const struct rect *b) {
+    for (int d = 0; d < DIMS; d++) {
+        if (b->min[d] < a->min[d] || b->max[d] > a->max[d]) { return false; }
+    }
+    return true;
+}
+
+bool matches(enum rtree_predicate pred, const struct rect *rect, const struct rect *w) {
+    switch (pred) {
+    case RTREE_WITHIN: return contains(w, rect);
+    case RTREE_CONTAINS: return contains(rect, w);
+    default: return intersects(rect, w);
+    }
+}
+
+bool same_rect(const NUMTYPE *min, const NUMTYPE *max, const struct rect *rect) {
+    return !memcmp(min, rect->min, sizeof(rect->min)) && !memcmp(max, rect->max, sizeof(rect->max));
+}
+
+// squared euclidean distance from the point to the closest point of the rect, as rtree_nearby orders by
+double box_dist(const struct rect *rect, const NUMTYPE *point) {
+    double dist = 0;
+    for (int d = 0; d < DIMS; d++) {
+        double e = point[d] < rect->min[d] ? rect->min[d] - point[d] : point[d] > rect->max[d] ? point[d] - rect->max[d] : 0;
+        dist += e * e;
+    }
+    return dist;
+}
+
+size_t alive_count(const struct model *m) {
+    size_t n = 0;
+    for (int i = 0; i < N; i++) { n += m->alive[i]; }
+    return n;
+}
+
+// the items a query reported, each checked against the model and the window as it comes in
+struct hits {
+    const struct model *m;
+    struct rect w;
+    enum rtree_predicate pred;
+    unsigned char seen[N];
+    size_t n;
+};
+
+void hits_begin(struct hits *h, const struct model *m, const struct rect *w, enum rtree_predicate pred) {
+    h->m = m;
+    h->w = *w;
+    h->pred = pred;
+    memset(h->seen, 0, sizeof(h->seen));
+    h->n = 0;
+}
+
+void hits_add(struct hits *h, const NUMTYPE *min, const NUMTYPE *max, const void *data) {
+    int i = index_of(data);
+    expect(i >= 0 && i < N);
+    expect(h->m->alive[i]);
+    expect(same_rect(min, max, &h->m->rects[i]));
+    expect(matches(h->pred, &h->m->rects[i], &h->w));
+    expect(!h->seen[i]);
+    h->seen[i] = 1;
+    h->n++;
+}
+
+// every item of the model that matches the window was reported
+void hits_end(struct hits *h) {
+    for (int i = 0; i < N; i++) {
+        expect(h->seen[i] == (h->m->alive[i] && matches(h->pred, &h->m->rects[i], &h->w)));
+    }
+}
+
+bool hits_iter(const NUMTYPE *min, const NUMTYPE *max, const void *data, void *udata) {
+    hits_add(udata, min, max, data);
+    return true;
+}
+
+static struct hits hits;
+
+// compares a tree with the model through every kind of search, all of which work on mapped trees as well
+void check(struct rtree *tr, const struct model *m) {
+    expect(rtree_count(tr) == alive_count(m));
+    struct rtree_stats stats;
+    rtree_stats(tr, &stats);
+    expect(stats.count == alive_count(m));
+    for (int q = 0; q < QUERIES; q++) {
+        struct rect w;
+        if (q == 0) {
+            full_window(&w);
+        } else {
+            gen_window(&w, q);
+        }
+        hits_begin(&hits, m, &w, RTREE_INTERSECTS);
+        rtree_search(tr, w.min, w.max, hits_iter, &hits);
+        hits_end(&hits);
+        expect(rtree_count_in(tr, w.min, w.max) == hits.n);
+        enum rtree_predicate pred = (enum rtree_predicate)(q % 3);
+        hits_begin(&hits, m, &w, pred);
+        rtree_search_ex(tr, w.min, w.max, pred, hits_iter, &hits);
+        hits_end(&hits);
+        if (q % 5 == 0) {
+            hits_begin(&hits, m, &w, RTREE_INTERSECTS);
+            struct rtree_cursor cur;
+            expect(rtree_cursor_open(&cur, tr, w.min, w.max));
+            const NUMTYPE *min, *max;
+            void *data;
+            while (rtree_cursor_next(&cur, &min, &max, &data)) {
+                hits_add(&hits, min, max, data);
+            }
+            rtree_cursor_close(&cur);
+            hits_end(&hits);
+        }
+    }
+}
+
+// the tree written by rtree_save or rtree_save_packed and mapped back
+struct rtree *mapped_copy(struct rtree *tr, bool packed) {
+    char path[] = "/tmp/rtree_test_XXXXXX";
+    int fd = mkstemp(path);
+    expect(fd >= 0);
+    close(fd);
+    expect(packed ? rtree_save_packed(tr, path) : rtree_save(tr, path));
+    struct rtree *mt = rtree_open_mmap(path);
+    unlink(path);
+    expect(mt);
+    return mt;
+}
+
+// saves the tree in both layouts and checks the mapped copies, which refuse writes
+void check_mapped(struct rtree *tr, const struct model *m) {
+    for (int packed = 0; packed < 2; packed++) {
+        struct rtree *mt = mapped_copy(tr, packed);
+        check(mt, m);
+        expect(!rtree_insert(mt, rects[0].min, rects[0].max, item_of(0)));
+        expect(!rtree_delete(mt, rects[0].min, rects[0].max, item_of(0)));
+        rtree_free(mt);
+    }
+}
+
+void insert(struct rtree *tr, struct model *m, int i) {
+    expect(rtree_insert(tr, m->rects[i].min, m->rects[i].max, item_of(i)));
+    m->alive[i] = true;
+}
+
+void delete(struct rtree *tr, struct model *m, int i) {
+    expect(rtree_delete(tr, m->rects[i].min, m->rects[i].max, item_of(i)));
+    m->alive[i] = false;
+}
+
+// items lo to hi by rtree_insert_batch, in batches of size
+void insert_batch(struct rtree *tr, struct model *m, int lo, int hi, int size) {
+    static struct rect rs[N];
+    static void *items[N];
+    for (int at = lo; at < hi; at += size) {
+        int n = 0;
+        for (int i = at; i < hi && i < at + size; i++) {
+            rs[n] = m->rects[i];
+            items[n++] = item_of(i);
+            m->alive[i] = true;
+        }
+        expect(rtree_insert_batch(tr, rs, items, n));
+    }
+}
+
+// every step'th item from lo to hi by one rtree_delete_batch, whether the tree holds it or not
+void delete_batch(struct rtree *tr, struct model *m, int lo, int hi, int step) {
+    static struct rect rs[N];
+    static void *items[N];
+    int n = 0;
+    for (int i = lo; i < hi; i += step) {
+        rs[n] = m->rects[i];
+        items[n++] = item_of(i);
+        m->alive[i] = false;
+    }
+    expect(rtree_delete_batch(tr, rs, items, n));
+}
+
+enum mode { MODE_PLAIN, MODE_QUADRATIC, MODE_RSTAR, MODE_HILBERT, MODE_CONCURRENT, MODES };
+
+const char *mode_names[MODES] = { "plain", "quadratic", "rstar", "hilbert", "concurrent" };
+
+struct rtree *new_tree(enum mode mode) {
+    struct rtree *tr = rtree_new();
+    expect(tr);
+    if (mode == MODE_QUADRATIC) {
+        rtree_set_split(tr, RTREE_SPLIT_QUADRATIC);
+    } else if (mode == MODE_RSTAR) {
+        rtree_set_split(tr, RTREE_SPLIT_RSTAR);
+    } else if (mode == MODE_HILBERT) {
+        NUMTYPE min[DIMS], max[DIMS];
+        for (int d = 0; d < DIMS; d++) {
+            min[d] = 0;
+            max[d] = SPACE;
+        }
+        expect(rtree_set_hilbert(tr, min, max));
+    } else if (mode == MODE_CONCURRENT) {
+        rtree_set_concurrent(tr, true);
+    }
+    return tr;
+}
+
+void model_reset(struct model *m) {
+    memcpy(m->rects, rects, sizeof(rects));
+    memset(m->alive, 0, sizeof(m->alive));
+}
+
+// writes of every kind, checked against the model after each step
+void test_writes(enum mode mode) {
+    struct rtree *tr = new_tree(mode);
+    model_reset(&model);
+    for (int i = 0; i < N / 2; i++) {
+        insert(tr, &model, i);
+    }
+    check(tr, &model);
+    insert_batch(tr, &model, N / 2, 3 * N / 4, 250);
+    check(tr, &model);
+    for (int i = 0; i < 3 * N / 4; i += 3) {
+        delete(tr, &model, i);
+    }
+    expect(rtree_delete(tr, rects[0].min, rects[0].max, item_of(0))); // a miss is no error
+    check(tr, &model);
+    for (int i = 1; i < 3 * N / 4; i += 5) {
+        if (!model.alive[i]) { continue; }
+        expect(rtree_update(tr, model.rects[i].min, model.rects[i].max, moved[i].min, moved[i].max, item_of(i)));
+        model.rects[i] = moved[i];
+    }
+    check(tr, &model);
+
+    struct rtree *cl = rtree_clone(tr);
+    expect(cl);
+    other = model;
+    delete_batch(tr, &model, N / 2, 3 * N / 4, 2);
+    insert_batch(cl, &other, 3 * N / 4, N, N);
+    for (int i = 2; i < N / 2; i += 4) {
+        if (other.alive[i]) { delete(cl, &other, i); }
+    }
+    check(tr, &model);
+    check(cl, &other);
+    rtree_free(cl);
+    check(tr, &model);
+
+    expect(rtree_compact(tr));
+    check(tr, &model);
+    check_mapped(tr, &model);
+
+    delete_batch(tr, &model, 0, N, 1);
+    expect(rtree_count(tr) == 0);
+    check(tr, &model);
+    insert_batch(tr, &model, 0, N / 4, N); // into the empty tree
+    check(tr, &model);
+    insert_batch(tr, &model, N / 4, N, N); // larger than the tree
+    check(tr, &model);
+    rtree_free(tr);
+}
+
+// bottom-up builds, into an empty tree and into a populated one
+void test_bulk_load(enum mode mode) {
+    struct rtree *tr = new_tree(mode);
+    model_reset(&model);
+    static void *items[N];
+    for (int i = 0; i < N; i++) {
+        items[i] = item_of(i);
+        model.alive[i] = i < N / 2;
+    }
+    expect(rtree_bulk_load(tr, rects, items, N / 2));
+    check(tr, &model);
+    for (int i = N / 2; i < N; i++) {
+        model.alive[i] = true;
+    }
+    expect(rtree_bulk_load(tr, &rects[N / 2], &items[N / 2], N - N / 2));
+    check(tr, &model);
+    rtree_free(tr);
+}
+
+// blocks the tree holds, counted by its allocator
+static size_t live_blocks;
+
+void *counting_malloc(size_t size) {
+    void *ptr = malloc(size);
+    if (ptr) { __atomic_add_fetch(&live_blocks, 1, __ATOMIC_RELAXED); }
+    return ptr;
+}
+
+void counting_free(void *ptr) {
+    if (ptr) { __atomic_sub_fetch(&live_blocks, 1, __ATOMIC_RELAXED); }
+    free(ptr);
+}
+
+// nodes come from the tree's slab pool, and every block of it goes back to the allocator with rtree_free
+void test_allocator() {
+    struct rtree *tr = rtree_new_with_allocator(counting_malloc, counting_free);
+    expect(tr);
+    model_reset(&model);
+    for (int i = 0; i < N; i++) {
+        insert(tr, &model, i);
+    }
+    for (int i = 0; i < N; i += 2) {
+        delete(tr, &model, i);
+    }
+    check(tr, &model);
+    expect(live_blocks > 0);
+    rtree_free(tr);
+    expect(live_blocks == 0);
+}
+
+bool nearby_iter(const NUMTYPE *min, const NUMTYPE *max, const void *data, double dist, void *udata) {
+    double *dists = udata;
+    int i = index_of(data);
+    expect(i >= 0 && i < N && model.alive[i]);
+    expect(same_rect(min, max, &model.rects[i]));
+    size_t k = (size_t)dists[0]++;
+    dists[k + 1] = dist;
+    return true;
+}
+
+int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// the k nearest items come in order of distance, and are as near as the k nearest of a scan. the same
+// goes for the mapped copies
+void test_nearby() {
+    struct rtree *tr = new_tree(MODE_PLAIN);
+    model_reset(&model);
+    for (int i = 0; i < N; i += 2) {
+        insert(tr, &model, i);
+    }
+    struct rtree *trees[3] = { tr, mapped_copy(tr, false), mapped_copy(tr, true) };
+    static double all[N];
+    for (int q = 0; q < QUERIES; q++) {
+        NUMTYPE point[DIMS];
+        for (int d = 0; d < DIMS; d++) {
+            point[d] = (NUMTYPE)(rnd() * SPACE);
+        }
+        size_t n = 0;
+        for (int i = 0; i < N; i++) {
+            if (model.alive[i]) { all[n++] = box_dist(&model.rects[i], point); }
+        }
+        qsort(all, n, sizeof(double), cmp_double);
+        for (int t = 0; t < 3; t++) {
+            double dists[NEARBY_K + 1] = { 0 };
+            expect(rtree_nearby(trees[t], point, NEARBY_K, nearby_iter, dists));
+            expect(dists[0] == NEARBY_K);
+            for (int k = 0; k < NEARBY_K; k++) {
+                expect(dists[k + 1] - all[k] < 1e-9 && all[k] - dists[k + 1] < 1e-9);
+            }
+        }
+    }
+    for (int t = 0; t < 3; t++) {
+        rtree_free(trees[t]);
+    }
+}
+
+bool batch_iter(size_t query, const NUMTYPE *min, const NUMTYPE *max, const void *data, void *udata) {
+    (void)min; (void)max; (void)data;
+    size_t *counts = udata;
+    counts[query]++; // every query runs on one thread
+    return true;
+}
+
+// queries of a batch find what rtree_search finds, results past the capacity are only counted. the same
+// goes for the mapped copies
+void test_search_batch() {
+    struct rtree *tr = new_tree(MODE_PLAIN);
+    model_reset(&model);
+    for (int i = 0; i < N; i++) {
+        insert(tr, &model, i);
+    }
+    struct rtree *trees[3] = { tr, mapped_copy(tr, false), mapped_copy(tr, true) };
+    static struct rtree_query queries[QUERIES];
+    static void *results[QUERIES][64];
+    for (int t = 0; t < 3; t++) {
+        size_t counts[QUERIES] = { 0 };
+        for (int q = 0; q < QUERIES; q++) {
+            struct rect w;
+            gen_window(&w, q);
+            memcpy(queries[q].min, w.min, sizeof(w.min));
+            memcpy(queries[q].max, w.max, sizeof(w.max));
+            queries[q].results = results[q];
+            queries[q].cap = 64;
+        }
+        expect(rtree_search_batch(trees[t], queries, QUERIES, batch_iter, counts, 4));
+        for (int q = 0; q < QUERIES; q++) {
+            struct rect w;
+            memcpy(w.min, queries[q].min, sizeof(w.min));
+            memcpy(w.max, queries[q].max, sizeof(w.max));
+            hits_begin(&hits, &model, &w, RTREE_INTERSECTS);
+            rtree_search(tr, w.min, w.max, hits_iter, &hits);
+            expect(queries[q].count == hits.n && counts[q] == hits.n);
+            for (size_t k = 0; k < MIN(queries[q].count, queries[q].cap); k++) {
+                int i = index_of(results[q][k]);
+                expect(i >= 0 && i < N && hits.seen[i]);
+            }
+        }
+    }
+    for (int t = 0; t < 3; t++) {
+        rtree_free(trees[t]);
+    }
+}
+
+// pairs are counted and hashed, so a missed pair cannot be made up for by a repeated one
+struct pairs {
+    uint64_t n;
+    uint64_t sum;
+};
+
+uint64_t pair_hash(int a, int b) {
+    uint64_t h = (uint64_t)a * 0x9e3779b97f4a7c15ULL ^ (uint64_t)b * 0xc2b2ae3d27d4eb4fULL;
+    return h ^ (h >> 29);
+}
+
+bool join_iter(const NUMTYPE *amin, const NUMTYPE *amax, const void *adata, const NUMTYPE *bmin, const NUMTYPE *bmax, const void *bdata, void *udata) {
+    struct pairs *p = udata;
+    int a = index_of(adata), b = index_of(bdata);
+    expect(a >= 0 && a < N && b >= 0 && b < N);
+    expect(same_rect(amin, amax, &model.rects[a]) && same_rect(bmin, bmax, &other.rects[b]));
+    __atomic_add_fetch(&p->n, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&p->sum, pair_hash(a, b), __ATOMIC_RELAXED);
+    return true;
+}
+
+// a spatial join reports the intersecting pairs of a scan of both trees, on one thread and on several
+void test_join() {
+    struct rtree *a = new_tree(MODE_PLAIN), *b = new_tree(MODE_RSTAR);
+    model_reset(&model);
+    model_reset(&other);
+    for (int i = 0; i < N; i++) {
+        other.rects[i] = moved[i];
+    }
+    for (int i = 0; i < N; i++) {
+        insert(a, &model, i);
+        if (i % 4 == 0) { insert(b, &other, i); }
+    }
+    struct pairs want = { 0 };
+    for (int i = 0; i < N; i++) {
+        for (int j = 0; j < N; j++) {
+            if (model.alive[i] && other.alive[j] && intersects(&model.rects[i], &other.rects[j])) {
+                want.n++;
+                want.sum += pair_hash(i, j);
+            }
+        }
+    }
+    expect(want.n > 0);
+    struct pairs got = { 0 };
+    expect(rtree_join(a, b, join_iter, &got));
+    expect(got.n == want.n && got.sum == want.sum);
+    memset(&got, 0, sizeof(got));
+    expect(rtree_join_parallel(a, b, join_iter, &got, 4));
+    expect(got.n == want.n && got.sum == want.sum);
+    rtree_free(a);
+    rtree_free(b);
+}
+
+// the sharded index against the model, before and after the shards are rebalanced
+void test_shards(bool concurrent) {
+    NUMTYPE min[DIMS], max[DIMS];
+    for (int d = 0; d < DIMS; d++) {
+        min[d] = 0;
+        max[d] = SPACE;
+    }
+    struct rtree_shards *s = rtree_shards_new(8, min, max);
+    expect(s);
+    rtree_shards_set_concurrent(s, concurrent);
+    model_reset(&model);
+    for (int i = 0; i < N / 2; i++) {
+        expect(rtree_shards_insert(s, rects[i].min, rects[i].max, item_of(i)));
+        model.alive[i] = true;
+    }
+    static void *items[N];
+    for (int i = N / 2; i < N; i++) {
+        items[i] = item_of(i);
+        model.alive[i] = true;
+    }
+    expect(rtree_shards_insert_batch(s, &rects[N / 2], &items[N / 2], N - N / 2, 4));
+    for (int i = 0; i < N; i += 5) {
+        expect(rtree_shards_delete(s, rects[i].min, rects[i].max, item_of(i)));
+        model.alive[i] = false;
+    }
+    for (int pass = 0; pass < 2; pass++) {
+        expect(rtree_shards_count(s) == alive_count(&model));
+        for (int q = 0; q < QUERIES; q++) {
+            struct rect w;
+            gen_window(&w, q);
+            hits_begin(&hits, &model, &w, RTREE_INTERSECTS);
+            rtree_shards_search(s, w.min, w.max, hits_iter, &hits);
+            hits_end(&hits);
+        }
+        expect(rtree_shards_rebalance(s));
+    }
+    rtree_shards_free(s);
+}
+
+// the model's points written as csv or binary records and read back with rtree_load_file
+void write_points(const char *path, enum rtree_file_format format, int lo, int hi) {
+    FILE *f = fopen(path, "w");
+    expect(f);
+    if (format == RTREE_FILE_CSV) {
+        fprintf(f, "x,y,id\n"); // a header line
+    }
+    for (int i = lo; i < hi; i++) {
+        struct rtree_point_record rec;
+        for (int d = 0; d < DIMS; d++) {
+            rec.coords[d] = model.rects[i].min[d];
+        }
+        rec.id = (uint64_t)(uintptr_t)item_of(i);
+        if (format == RTREE_FILE_CSV) {
+            for (int d = 0; d < DIMS; d++) {
+                fprintf(f, "%.17g,", rec.coords[d]);
+            }
+            fprintf(f, "%llu\n", (unsigned long long)rec.id);
+        } else {
+            expect(fwrite(&rec, sizeof(rec), 1, f) == 1);
+        }
+    }
+    expect(fclose(f) == 0);
+}
+
+// loads a csv file into an empty tree and a binary one on top of it
+void test_load_file() {
+    model_reset(&model);
+    for (int i = 0; i < N; i++) {
+        memcpy(model.rects[i].max, model.rects[i].min, sizeof(model.rects[i].min)); // the files hold points
+    }
+    char csv[] = "/tmp/rtree_test_XXXXXX", bin[] = "/tmp/rtree_test_XXXXXX";
+    int fd = mkstemp(csv);
+    expect(fd >= 0);
+    close(fd);
+    fd = mkstemp(bin);
+    expect(fd >= 0);
+    close(fd);
+    write_points(csv, RTREE_FILE_CSV, 0, N / 2);
+    write_points(bin, RTREE_FILE_BINARY, N / 2, N);
+    struct rtree *tr = new_tree(MODE_PLAIN);
+    expect(rtree_load_file(tr, csv, RTREE_FILE_CSV, 3));
+    for (int i = 0; i < N / 2; i++) {
+        model.alive[i] = true;
+    }
+    check(tr, &model);
+    expect(rtree_load_file(tr, bin, RTREE_FILE_BINARY, 3));
+    for (int i = N / 2; i < N; i++) {
+        model.alive[i] = true;
+    }
+    check(tr, &model);
+    expect(!rtree_load_file(tr, "/nonexistent/points.csv", RTREE_FILE_CSV, 1));
+    unlink(csv);
+    unlink(bin);
+    rtree_free(tr);
+}
+
+// readers of the concurrent mode test, they only see rects the writer used for an item
+struct race {
+    struct rtree *tr;
+    int done;
+    size_t rounds;
+};
+
+void check_seen(const NUMTYPE *min, const NUMTYPE *max, const void *data, unsigned char *seen) {
+    int i = index_of(data);
+    expect(i >= 0 && i < N);
+    expect(same_rect(min, max, &rects[i]) || same_rect(min, max, &moved[i]));
+    if (seen) {
+        expect(!seen[i]);
+        seen[i] = 1;
+    }
+}
+
+bool race_iter(const NUMTYPE *min, const NUMTYPE *max, const void *data, void *udata) {
+    check_seen(min, max, data, udata);
+    return true;
+}
+
+bool race_nearby_iter(const NUMTYPE *min, const NUMTYPE *max, const void *data, double dist, void *udata) {
+    double *last = udata;
+    check_seen(min, max, data, NULL);
+    expect(dist >= *last);
+    *last = dist;
+    return true;
+}
+
+bool race_batch_iter(size_t query, const NUMTYPE *min, const NUMTYPE *max, const void *data, void *udata) {
+    (void)query; (void)udata;
+    check_seen(min, max, data, NULL);
+    return true;
+}
+
+void *race_reader(void *arg) {
+    struct race *r = arg;
+    unsigned char seen[N];
+    size_t rounds = 0;
+    while (!__atomic_load_n(&r->done, __ATOMIC_ACQUIRE)) {
+        struct rect w;
+        full_window(&w);
+        memset(seen, 0, sizeof(seen));
+        struct rtree_cursor cur;
+        expect(rtree_cursor_open(&cur, r->tr, w.min, w.max));
+        const NUMTYPE *min, *max;
+        void *data;
+        size_t n = 0;
+        while (rtree_cursor_next(&cur, &min, &max, &data)) {
+            check_seen(min, max, data, seen);
+            n++;
+        }
+        rtree_cursor_close(&cur);
+        expect(n <= N);
+        w = rects[rounds % N];
+        for (int d = 0; d < DIMS; d++) {
+            w.min[d] -= 5;
+            w.max[d] += 5;
+        }
+        memset(seen, 0, sizeof(seen));
+        rtree_search(r->tr, w.min, w.max, race_iter, seen);
+        expect(rtree_count_in(r->tr, w.min, w.max) <= rtree_count(r->tr));
+        double last = 0;
+        expect(rtree_nearby(r->tr, w.min, 8, race_nearby_iter, &last));
+        struct rtree_query queries[QUERIES] = { 0 }; // the readers take turns with the tree's threads
+        for (int q = 0; q < QUERIES; q++) {
+            for (int d = 0; d < DIMS; d++) {
+                queries[q].min[d] = rects[(rounds + q) % N].min[d] - 5;
+                queries[q].max[d] = rects[(rounds + q) % N].max[d] + 5;
+            }
+        }
+        expect(rtree_search_batch(r->tr, queries, QUERIES, race_batch_iter, NULL, 2));
+        rounds++;
+    }
+    __atomic_add_fetch(&r->rounds, rounds, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+// one writer goes through every kind of write while readers search the published snapshots
+void test_concurrent() {
+    struct rtree *tr = new_tree(MODE_CONCURRENT);
+    model_reset(&model);
+    struct race r = { .tr = tr };
+    pthread_t readers[READERS];
+    for (int t = 0; t < READERS; t++) {
+        expect(pthread_create(&readers[t], NULL, race_reader, &r) == 0);
+    }
+    for (int i = 0; i < N / 2; i++) {
+        insert(tr, &model, i);
+    }
+    insert_batch(tr, &model, N / 2, N, 200);
+    struct rtree *cl = rtree_clone(tr);
+    expect(cl);
+    other = model;
+    for (int i = 0; i < N; i += 3) {
+        delete(tr, &model, i);
+    }
+    delete_batch(tr, &model, 1, N, 7);
+    for (int i = 2; i < N; i += 5) {
+        if (!model.alive[i]) { continue; }
+        expect(rtree_update(tr, model.rects[i].min, model.rects[i].max, moved[i].min, moved[i].max, item_of(i)));
+        model.rects[i] = moved[i];
+    }
+    expect(rtree_compact(tr));
+    for (int i = 0; i < N / 2; i += 4) {
+        delete(cl, &other, i);
+    }
+    __atomic_store_n(&r.done, 1, __ATOMIC_RELEASE);
+    for (int t = 0; t < READERS; t++) {
+        pthread_join(readers[t], NULL);
+    }
+    expect(r.rounds > 0);
+    check(tr, &model);
+    check(cl, &other);
+    rtree_free(cl);
+    rtree_free(tr);
+}
+
+int main(int argc, char **argv) {
+    for (int i = 0; i < N; i++) {
+        gen_rect(&rects[i], i);
+        gen_rect(&moved[i], i);
+    }
+    bool concurrent_only = argc > 1 && !strcmp(argv[1], "concurrent");
+    if (!concurrent_only) {
+        for (int mode = 0; mode < MODES; mode++) {
+            test_writes((enum mode)mode);
+            test_bulk_load((enum mode)mode);
+            printf("ok %s\n", mode_names[mode]);
+        }
+        test_allocator();
+        printf("ok allocator\n");
+        test_nearby();
+        test_search_batch();
+        test_join();
+        printf("ok queries\n");
+        test_shards(false);
+        test_shards(true);
+        printf("ok shards\n");
+        test_load_file();
+        printf("ok load_file\n");
+    }
+    test_concurrent();
+    printf("ok concurrent\n");
+    return 0;
+}